@@ -35,6 +35,11 @@
 #define         DO_DEVICE_DEBUG                 FALSE
 #define         DO_MEMORY_DEBUG                 FALSE
 
+//  Change FALSE to TRUE to put a TLB between the processor and the page
+//  table.  Translations are then cached in hardware, a miss costs
+//  COST_OF_TLB_MISS, and the OS must flush entries it invalidates.
+#define         DO_TLB                          FALSE
+
 //  These four are very useful for my debugging the hardware,
 //  but are probably less useful for students.  Use these ONLY
 //  if you are seriously desperate.
@@ -43,7 +43,8 @@ char *call_names[] = {"MemRead  ", "MemWrite ", "ReadMod  ", "GetTime  ",
     "Resume   ", "ChPrior  ", "Send     ", "Receive  ", "PhyDskRd ",
     "PhyDskWrt", "DefShArea", "Format   ", "CheckDisk", "OpenDir  ",
     "OpenFile ", "CreaDir  ", "CreaFile ", "ReadFile ", "WriteFile",
-    "CloseFile", "DirContnt", "DelDirect", "DelFile  " };
+    "CloseFile", "DirContnt", "DelDirect", "DelFile  ", "MapFile  ",
+    "UnmapFile", "SyncDisk " };
 
 /************************************************************************
  INTERRUPT_HANDLER
@@ -63,43 +64,325 @@ char *call_names[] = {"MemRead  ", "MemWrite ", "ReadMod  ", "GetTime  ",
 //Here Define the global variable
 
 int Inode=0;
-int BitMap[8][NUMBER_LOGICAL_SECTORS];
+//  Sectors in use, a bit each, for the file system and swap alike.  The
+//  search for a free one starts at the word of the last one handed out.
+//  Words changed since they were last saved are marked by bitmap sector.
+unsigned long long BitMap[MAX_NUMBER_OF_DISKS][BITMAP_WORDS];
+int BitMapHint[MAX_NUMBER_OF_DISKS];
+UINT32 BitMapDirtySectors[MAX_NUMBER_OF_DISKS];
+bool BitMapOnDisk[MAX_NUMBER_OF_DISKS];
 int MaxSchedulePrint;
 int MaxSentTime;
 int PCBQueueID;
 int TimerQueueID;
-int DiskQueueID;
 int ReadyQueueID;
 int TimerSuspendQ;
 int MessageQueueID;
 int MessageSuspendedQ;
 int TerminatedQueueID;
+int InactiveQueueID;
 char ReadyQueueName[]="ReadyQueue";
 char TimerQueueName[]="TimerQueue";
 char PCBQueueName[]="PCBQueue";
-char DiskQueueName[]="DiskQueue";
 char MessageQueueName[]="MessageQueue";
 char TimerSuspend[]="TimerSuspend";
 char TerminatedQueueName[]="TerminatedQueueName";
 char MessageSuspendedQueueName[]="MessageSusQName";
+char InactiveQueueName[]="InactiveQueue";
+
+//  Each disk runs one request at a time; the rest wait on that disk's list
+//  in arrival order, and DISK_SCHEDULER picks which goes next.  The disk
+//  interrupt finishes the request in flight, wakes the process waiting for
+//  it and starts the next one.
+typedef struct Disk_Request{
+    INT16 DiskID;
+    INT16 SectorID;
+    char *Buffer;
+    INT32 Mode;
+    INT32 Done;
+    INT32 Orphaned;       // Its process went away; the interrupt frees it
+    PCB *Owner;
+    PCB *Waiter;
+    long IssueTime;
+    struct Disk_Request *Merged;   // Requests for the same sector riding on this one
+    struct Disk_Request *next;
+}DiskRequest;
+
+DiskRequest *DiskInFlight[MAX_NUMBER_OF_DISKS];
+DiskRequest *DiskWaitingHead[MAX_NUMBER_OF_DISKS];
+DiskRequest *DiskWaitingTail[MAX_NUMBER_OF_DISKS];
+long DiskRequests;
+long DiskRequestsQueued;
+long DiskBlockedWaits;
+
+//  The head is wherever the last request issued to the disk left it
+INT16 DiskHeadSector[MAX_NUMBER_OF_DISKS];
+INT16 DiskSweepUp[MAX_NUMBER_OF_DISKS];      // SCAN direction
+INT32 DiskQueueLength[MAX_NUMBER_OF_DISKS];
+
+//  Per-disk scheduling statistics
+long DiskArrivals[MAX_NUMBER_OF_DISKS];
+long DiskQueueDepthSum[MAX_NUMBER_OF_DISKS];
+long DiskMerges[MAX_NUMBER_OF_DISKS];
+long DiskIssued[MAX_NUMBER_OF_DISKS];
+long DiskSeekDistance[MAX_NUMBER_OF_DISKS];
+long DiskServiceTime[MAX_NUMBER_OF_DISKS];
+
+//  True while the dispatcher itself is running; disk waits there idle
+//  rather than dispatch again.
+bool InDispatcher;
+
+//  Bumped by the interrupt thread as each interrupt finishes being handled
+volatile long InterruptsHandled;
+
+//  A process may now block in the middle of the pager or the file system,
+//  so each is held by one process at a time.  Both are recursive, and a
+//  process wanting the file system takes it before the pager.
+typedef struct Kernel_Mutex{
+    PCB *Holder;
+    INT32 Depth;
+    int WaitQueueID;
+}KernelMutex;
+
+KernelMutex PagerMutex;
+KernelMutex FileSystemMutex;
+char PagerWaitQueueName[]="PagerWait";
+char FileSystemWaitQueueName[]="FileSystemWait";
 
 
 int LRUQueueID;
 char LRUQueue[]="LRU";
 
-struct {
+//  One entry per physical frame; allocated in osInit since the number
+//  of frames is only known once the hardware is configured.
+//  Owner and PTE are the reverse map: eviction goes straight to the page
+//  table entry that maps the frame, whichever process it belongs to.
+struct Frame_Entry {
     INT16  InUse;         // TRUE == in use, FALSE == not in use
     INT16  Pid;           // The Process holding this frame
     INT16  LogicalPage;   // The logical page in that process
     INT16  State;         // The state of the frame.
-} Frame[NUMBER_PHYSICAL_PAGES];
-
-struct {
-    INT16  InUse;         // TRUE == in use, FALSE == not in use
-    INT32  ProcessID;           // The Process holding this frame
-    INT16  virtualPage;   // The logical page in that process
-    INT16  SectorID;         // The state of the frame.
-} SwapArea[500];
+    INT32  Prefetched;    // Fault-around batch that brought it in, 0 once used
+    PCB    *Owner;        // The PCB of that process
+    UINT16 *PTE;          // The page table entry mapping this frame
+    struct Shared_Area *Shared;   // Set for the pinned frames of a shared area
+    struct Merge_Mapping *Merged; // Other PTEs mapping this frame read-only
+} *Frame;
+
+//  When identical frames are merged, the surviving frame's owner stays in
+//  Owner/PTE and everyone else mapping it is on this list.  All of those
+//  PTEs are read only until the page is written and gets a frame again.
+typedef struct Merge_Mapping{
+    PCB    *Owner;
+    INT16  LogicalPage;
+    UINT16 *PTE;
+    struct Merge_Mapping *next;
+}MergeMapping;
+
+long MergeScans;
+long PagesMerged;
+long MergedPages;           // Mappings now sharing another's frame == frames saved
+long Unmerges;
+int FaultsSinceMergeScan;
+
+//  A shared area is a run of frames mapped into every process that names
+//  the same tag, each at its own virtual address.  The frames are pinned
+//  and are only freed when the last process using the area goes away.
+typedef struct Shared_Attach{
+    INT32  ProcessID;           // A process using the area
+    struct Shared_Attach *next;
+}SharedAttach;
+
+typedef struct Shared_Area{
+    char   Tag[SHARED_AREA_TAG_LENGTH];
+    INT32  Pages;
+    INT32  *Frames;             // The physical frame behind each page
+    INT32  Users;               // Processes mapping it; the frames' reference count
+    INT32  NextSharedID;        // Handed to the next process to join
+    SharedAttach *Attached;
+    struct Shared_Area *next;
+}SharedArea;
+
+SharedArea *SharedAreas;
+int SharedFrames;
+
+//  A file mapping binds a run of a process's virtual pages to a file's
+//  data blocks.  The block sectors are looked up once, when the file is
+//  mapped, so a fault goes straight to the sector without an index walk.
+//  Mapped pages never go to swap: evicting one writes it to its sector.
+typedef struct File_Mapping{
+    PCB    *Owner;
+    long   Inode;
+    INT16  DiskID;
+    INT32  StartPage;
+    INT32  Pages;
+    short  *Sectors;            // Data block behind each page of the range
+    struct File_Mapping *next;
+}FileMapping;
+
+FileMapping *FileMappings;
+long MappedFileFaults;
+long FileWritebacks;
+
+//  The swap map remembers where on the swap disk each (pid, virtual page)
+//  lives.  It is a chained hash table so that page-in and page-out
+//  don't have to scan every swap slot.
+typedef struct Swap_Entry{
+    INT32  ProcessID;           // The Process owning this page
+    INT16  virtualPage;         // The logical page in that process
+    INT16  DiskID;              // Which swap disk holds the page
+    INT16  SectorID;            // Where the page lives on that disk
+    INT16  CopyValid;           // TRUE == the disk copy matches the last page-in
+    struct Swap_Cache_Entry *Cached;    // Compressed copy held in memory, if any
+    struct Swap_Entry *next;    // Next entry in the same bucket
+}SwapEntry;
+
+//  Evicted pages go into a bounded, compressed swap cache first, and only
+//  the oldest of them are spilled to the swap disk.  A page is compressed
+//  by dropping its zero words; WordMask says which words were kept.
+typedef struct Swap_Cache_Entry{
+    SwapEntry *owner;           // The swap map entry this page belongs to
+    unsigned char WordMask[SWAP_CACHE_HEADER_BYTES];   // Bit i set == word i of the page is in Data
+    INT16  Length;              // Bytes held in Data
+    char   *Data;
+    struct Swap_Cache_Entry *prev;      // Older in the LRU list
+    struct Swap_Cache_Entry *next;      // Newer in the LRU list
+}SwapCacheEntry;
+
+SwapCacheEntry *SwapCacheOldest;
+SwapCacheEntry *SwapCacheNewest;
+int SwapCacheUsed;
+long SwapCacheHits;
+long SwapCacheMisses;
+long SwapCacheSpills;
+long SwapCacheBytesIn;
+long SwapCacheBytesStored;
+
+SwapEntry *SwapHash[SWAP_HASH_BUCKETS];
+SwapEntry *SwapEntryFreeList;
+
+//  Swap slots are striped round robin over SWAP_DISK_COUNT disks.  Each
+//  disk hands out slots from a stack of released sectors, and only when
+//  that is empty does it move its high water mark forward.
+short *SwapFreeSlots[MAX_NUMBER_OF_DISKS];
+int SwapFreeSlotCount[MAX_NUMBER_OF_DISKS];
+int SwapFreeSlotCapacity[MAX_NUMBER_OF_DISKS];
+int SwapNextSector[MAX_NUMBER_OF_DISKS];
+int SwapNextDisk;
+long SwapTransfers;
+long SwapTransferBatches;
+
+//  Victims whose swap copy is still good are dropped without any I/O
+long CleanEvictions;
+long DirtyEvictions;
+
+//  The page-out daemon keeps FreeFrameCount between the watermarks so a
+//  fault normally finds a free frame waiting for it.
+int FreeFrameCount;
+int PageOutHand;
+long DaemonEvictions;
+long FaultsWithFreeFrame;
+long FaultsWithEviction;
+
+//  Size of the hardware TLB, 0 if there isn't one.  When there is, any
+//  page table entry we invalidate has to be flushed from it.
+INT32 TLBEntries;
+
+//  First-touch pages are zero-filled; only pages with a swap copy are read
+long ZeroFillFaults;
+long SwapInFaults;
+
+//  Fault-around: pages brought in ahead of demand, and what became of them
+long PrefetchBatch;
+long PrefetchedPages;
+long PrefetchHits;
+long WastedPrefetches;
+
+//  Load control (medium-term scheduling)
+long LoadFaultsInWindow;
+long LoadWindowStart;
+long Deactivations;
+long Reactivations;
+long LoadControlPageOuts;
+
+//  The buffer cache holds recently used file-system sectors, keyed by
+//  (disk, sector).  A write only dirties the cached copy; it reaches the
+//  disk when the entry is evicted, when the idle flusher finds it old
+//  enough, or at SYNC_DISK.
+typedef struct Buffer_Entry{
+    INT16  DiskID;
+    INT16  SectorID;
+    INT16  Queue;               // BUFFER_FREE, BUFFER_PROBATION or BUFFER_MAIN
+    INT16  Dirty;
+    long   DirtyTime;           // When it was dirtied, if it is
+    char   Data[PGSIZE];
+    struct Buffer_Entry *hashNext;
+    struct Buffer_Entry *prev;  // Older in its queue
+    struct Buffer_Entry *next;  // Newer in its queue
+}BufferEntry;
+
+typedef struct Buffer_Queue{
+    BufferEntry *Oldest;
+    BufferEntry *Newest;
+    int Count;
+}BufferQueue;
+
+BufferEntry BufferEntries[BUFFER_CACHE_SECTORS];
+int BufferEntriesUsed;
+BufferEntry *BufferHash[BUFFER_CACHE_BUCKETS];
+BufferQueue BufferQueues[3];                // Indexed by an entry's Queue
+int BufferDirtyCount;
+//  2Q's ghosts: sectors recently dropped from probation, without their data
+INT32 BufferGhosts[BUFFER_CACHE_GHOSTS];
+int BufferGhostNext;
+long BufferCacheHits;
+long BufferCacheMisses;
+long BufferCacheWriteBacks;
+long BufferCacheEvictions;
+long BufferCacheIdleFlushes;
+
+//  The index cache keeps, for each recently used file, the index nodes of
+//  its last walk down the tree, decoded, and the last block it found.  A
+//  file is known by the sector of its root index block, which changes
+//  whenever the tree grows a level.  Writing any index block it holds
+//  drops the file.
+typedef struct Index_Cache_Entry{
+    INT16  DiskID;
+    INT16  RootSector;          // 0 == slot unused
+    INT16  Level;
+    INT16  NodeSector[INDEX_CACHE_LEVELS];      // Root first; -1 == not read
+    short  Node[INDEX_CACHE_LEVELS][PGSIZE/2];
+    INT32  LastIndex;           // -1 == none yet
+    INT16  LastSector;
+    long   LastUsed;
+}IndexCacheEntry;
+
+IndexCacheEntry IndexCache[INDEX_CACHE_FILES];
+long IndexCacheClock;
+long IndexTranslations;
+long IndexMemoHits;
+long IndexNodeReads;
+
+//  The dentry cache remembers name lookups in a directory, which is named
+//  by the sector of its header.  A SectorID of -1 records that the name
+//  isn't there.  Every directory change goes through
+//  CreatefileorDirectory, which keeps it current.  Slots are reused
+//  oldest first.
+typedef struct Dentry_Entry{
+    INT16  DiskID;
+    INT16  ParentSector;
+    INT16  Flag;                // 1 == directory, 0 == file
+    INT16  SectorID;            // Header sector of the entry, or -1
+    INT16  InUse;
+    char   Name[DENTRY_NAME_LENGTH+1];
+    struct Dentry_Entry *next;
+}DentryEntry;
+
+DentryEntry DentryEntries[DENTRY_CACHE_ENTRIES];
+DentryEntry *DentryHash[DENTRY_HASH_BUCKETS];
+int DentryNextSlot;
+long DentryHits;
+long DentryMisses;
 
 
 typedef union {
@@ -119,6 +402,12 @@ PCB *newPCB;
 PCB *pcbHead;
 PCB *pcbEnd;
 
+//Deferred work the dispatcher runs while no process is ready
+int PageOutDaemon(int cleanOnly);
+int MergeScan();
+int LoadControl(int idle);
+int BufferCacheIdleFlush();
+
 Header *convertInodeinfotoHeader(Inodeinfo *inodeinfo){
     Header *head=(Header*)malloc(sizeof(Header));
     head->Creation_Time=inodeinfo->Creation_Time;
@@ -341,18 +630,59 @@ bool ReadyQueueisEmpty(){
 void wasteTime(){
 }
 
+//  Z502Idle returns once the next interrupt is raised, not once it has been
+//  handled.  Idling again before the handler is done would find the event
+//  queue empty, so wait for it here.  The caller reads InterruptsHandled
+//  before it checks what it is waiting for.
+void osIdleUntilInterrupt(long handled){
+    osCauseZ502Idle();
+    while(InterruptsHandled==handled){
+    }
+}
+
 void osDispatcher() {
+    InDispatcher=true;
+//    Pager work waits while some process is blocked inside the pager
+    if(PagerMutex.Holder==NULL){
+        LoadControl(false);
+    }
     while(ReadyQueueisEmpty()==true) {
-        CALL(wasteTime());
+        if(PagerMutex.Holder==NULL && LoadControl(true)>0){
+            break;
+        }
+        if(PagerMutex.Holder==NULL && PAGE_MERGING && FaultsSinceMergeScan>0 && FreeFrameCount<PAGEOUT_HIGH_WATERMARK){
+            FaultsSinceMergeScan=0;
+            MergeScan();
+        }
+//        Write-back is only worth the disk time once the pool runs low
+        if(PagerMutex.Holder==NULL && FreeFrameCount<PAGEOUT_HIGH_WATERMARK){
+            PageOutDaemon(FreeFrameCount>=PAGEOUT_LOW_WATERMARK);
+        }
+//        The disks have time for the file system's older dirty sectors
+        if(FileSystemMutex.Holder==NULL && BufferDirtyCount>0){
+            BufferCacheIdleFlush();
+        }
+//        Nothing left to do until the next interrupt
+        long handled=InterruptsHandled;
+        if(ReadyQueueisEmpty()==true){
+            osIdleUntilInterrupt(handled);
+        }
     }
+    Lock(ReadyLockAddress);
     PCB *ReadyFrontPCB=(PCB *)QRemoveHead(ReadyQueueID);
+    UnLock(ReadyLockAddress);
+    InDispatcher=false;
     osStartContext(ReadyFrontPCB->currentContext);
-    osCauseZ502Idle();
     char stateinput[10]="Dispacher";
     SchedulePrinter(stateinput);
 }
 
 void AddtoReadyQueue(PCB *pcb){
+//    A swapped-out process waits for load control instead
+    if(pcb->LoadState!=LOAD_ACTIVE){
+        pcb->LoadState=LOAD_DEACTIVATED_READY;
+        return;
+    }
     Lock(ReadyLockAddress);
     QInsert(ReadyQueueID, pcb->processPriority,pcb);
     UnLock(ReadyLockAddress);
@@ -380,10 +710,6 @@ void RemovefromReadyQueue(PCB *pcb){
     QRemoveItem(ReadyQueueID, pcb);
 }
 
-void RemoveDiskQueueProcess(PCB *pcb){
-    QRemoveItem(DiskQueueID, pcb);
-}
-
 void Process_Sleep(long Time_Sleep){
     INT32 CurrentProcessID=osGetCurrentProcessID();
     PCB *currentpcb=GetProcessByID(CurrentProcessID);
@@ -447,27 +773,198 @@ long osGet_Process_ID(char ProcessName[30],long *ProcessID){
 }
 
 
-void RemovePCBInDiskQueue(int DiskID){
-    Lock(DiskLockAddress);
-    int i=0;
-    while((int)(QWalk(DiskQueueID, i))!=-1){
-        PCB *pcb=QWalk(DiskQueueID, i);
-//        pcb=QRemoveItem(DiskQueueID, pcb);
-//        AddtoReadyQueue(pcb);
-//        break;
-        if(pcb->DiskID==DiskID){
-            Lock(DiskLockAddress);
-            pcb=QRemoveItem(DiskQueueID, pcb);
-            UnLock(DiskLockAddress);
-            AddtoReadyQueue(pcb);
-            break;
+//Put a process blocked in the kernel back on the ready queue.  A suspended
+//one is left for RESUME_PROCESS to put there.
+void osWakeProcess(PCB *pcb){
+    if(pcb->processStatus==Suspended){
+        return;
+    }
+    AddtoReadyQueue(pcb);
+}
+
+//Finish a request and wake its process.  Done is set last: once it is,
+//the waiting process may free the request.  A read riding on this one
+//gets a copy of the sector; a write riding on it was carried out by it.
+void osCompleteDiskRequest(DiskRequest *request){
+    while(request->Merged!=NULL){
+        DiskRequest *rider=request->Merged;
+        request->Merged=rider->Merged;
+        rider->Merged=NULL;
+        if(rider->Mode==Z502DiskRead){
+            memcpy(rider->Buffer, request->Buffer, PGSIZE);
         }
-        i++;
+        osCompleteDiskRequest(rider);
+    }
+    PCB *waiter=request->Waiter;
+    request->Waiter=NULL;
+    if(request->Orphaned==TRUE){
+        free(request);
+        return;
+    }
+    request->Done=TRUE;
+    if(waiter!=NULL){
+        osWakeProcess(waiter);
+    }
+}
+
+//A request the disk refuses (a bad sector, say) never interrupts, so it
+//is finished here instead
+bool osIssueDiskRequest(DiskRequest *request){
+    MEMORY_MAPPED_IO mmio;
+    INT16 DiskID=request->DiskID;
+    DiskInFlight[DiskID]=request;
+    mmio.Mode=request->Mode;
+    mmio.Field1=request->DiskID;
+    mmio.Field2=request->SectorID;
+    mmio.Field3=(long)request->Buffer;
+    mmio.Field4=0;
+    MEM_WRITE(Z502Disk, &mmio);
+    if(mmio.Field4!=ERR_SUCCESS){
+        DiskInFlight[DiskID]=NULL;
+        osCompleteDiskRequest(request);
+        return false;
+    }
+    DiskIssued[DiskID]++;
+    DiskSeekDistance[DiskID]+=abs(request->SectorID-DiskHeadSector[DiskID]);
+    DiskHeadSector[DiskID]=request->SectorID;
+    request->IssueTime=Get_CurrentTime();
+    return true;
+}
+
+//The waiting request the scheduling policy serves next.  Ties go to the
+//earliest arrival, so requests for one sector keep their order.
+DiskRequest *osSelectDiskRequest(INT16 DiskID){
+    DiskRequest *best=NULL;
+    INT16 head=DiskHeadSector[DiskID];
+    if(DISK_SCHEDULER==DISK_SCHED_FIFO){
+        return DiskWaitingHead[DiskID];
+    }
+    for(int pass=0;pass<2 && best==NULL;pass++){
+        for(DiskRequest *request=DiskWaitingHead[DiskID];request!=NULL;request=request->next){
+            INT16 sector=request->SectorID;
+            if(DISK_SCHEDULER==DISK_SCHED_SSTF){
+                if(best==NULL || abs(sector-head)<abs(best->SectorID-head)){
+                    best=request;
+                }
+            }
+            else if(DISK_SCHEDULER==DISK_SCHED_SCAN){
+//                Nearest in the direction of travel
+                if((DiskSweepUp[DiskID] && sector>=head) || (!DiskSweepUp[DiskID] && sector<=head)){
+                    if(best==NULL || abs(sector-head)<abs(best->SectorID-head)){
+                        best=request;
+                    }
+                }
+            }
+            else{
+//                Nearest at or above the head; on the second pass the lowest
+                if(pass==1 || sector>=head){
+                    if(best==NULL || sector<best->SectorID){
+                        best=request;
+                    }
+                }
+            }
+        }
+        if(best==NULL && DISK_SCHEDULER==DISK_SCHED_SCAN){
+            DiskSweepUp[DiskID]=!DiskSweepUp[DiskID];
+        }
+    }
+    return best;
+}
+
+void osRemoveWaitingDiskRequest(INT16 DiskID,DiskRequest *request){
+    DiskRequest **link=&DiskWaitingHead[DiskID];
+    DiskRequest *previous=NULL;
+    while(*link!=request){
+        previous=*link;
+        link=&(*link)->next;
+    }
+    *link=request->next;
+    if(DiskWaitingTail[DiskID]==request){
+        DiskWaitingTail[DiskID]=previous;
+    }
+    request->next=NULL;
+    DiskQueueLength[DiskID]--;
+}
+
+void osStartNextDiskRequest(INT16 DiskID){
+    while(DiskWaitingHead[DiskID]!=NULL){
+        DiskRequest *next=osSelectDiskRequest(DiskID);
+        osRemoveWaitingDiskRequest(DiskID, next);
+        if(osIssueDiskRequest(next)){
+            return;
+        }
+    }
+}
+
+//The request in flight on this disk has finished
+void osDiskInterrupt(INT16 DiskID){
+    Lock(DiskLockAddress);
+    DiskRequest *request=DiskInFlight[DiskID];
+    DiskInFlight[DiskID]=NULL;
+    if(request!=NULL){
+        DiskServiceTime[DiskID]+=Get_CurrentTime()-request->IssueTime;
+        osCompleteDiskRequest(request);
     }
+    osStartNextDiskRequest(DiskID);
     UnLock(DiskLockAddress);
 }
 
+//Take a mutex, blocking while another process holds it
+void KernelMutexAcquire(KernelMutex *mutex){
+    PCB *pcb=GetProcessByID(osGetCurrentProcessID());
+    while(mutex->Holder!=NULL && mutex->Holder!=pcb){
+        if(QItemExists(mutex->WaitQueueID, pcb)==(void *)-1){
+            QInsertOnTail(mutex->WaitQueueID, pcb);
+        }
+        osDispatcher();
+    }
+    mutex->Holder=pcb;
+    mutex->Depth++;
+}
+
+//The last release hands the mutex straight to the first waiter
+void KernelMutexRelease(KernelMutex *mutex){
+    if(--mutex->Depth>0){
+        return;
+    }
+    mutex->Holder=NULL;
+    if(QNextItemInfo(mutex->WaitQueueID)!=(void *)-1){
+        PCB *next=(PCB *)QRemoveHead(mutex->WaitQueueID);
+        mutex->Holder=next;
+        osWakeProcess(next);
+    }
+}
+
+//A process going away stops waiting and gives up what it holds
+void KernelMutexDetach(KernelMutex *mutex,PCB *pcb){
+    if(QItemExists(mutex->WaitQueueID, pcb)!=(void *)-1){
+        QRemoveItem(mutex->WaitQueueID, pcb);
+    }
+    if(mutex->Holder==pcb){
+        mutex->Depth=1;
+        KernelMutexRelease(mutex);
+    }
+}
 
+//A request whose process went away is freed by its interrupt instead
+void DiskRequestsDetach(PCB *pcb){
+    Lock(DiskLockAddress);
+    for(int d=0;d<MAX_NUMBER_OF_DISKS;d++){
+        if(DiskInFlight[d]!=NULL && DiskInFlight[d]->Owner==pcb){
+            DiskInFlight[d]->Waiter=NULL;
+            DiskInFlight[d]->Orphaned=TRUE;
+        }
+        for(DiskRequest *queued=DiskWaitingHead[d];queued!=NULL;queued=queued->next){
+            for(DiskRequest *request=queued;request!=NULL;request=request->Merged){
+                if(request->Owner==pcb){
+                    request->Waiter=NULL;
+                    request->Orphaned=TRUE;
+                }
+            }
+        }
+    }
+    UnLock(DiskLockAddress);
+}
 
 void InterruptHandler(void) {
     INT32 DeviceID;
@@ -512,34 +1009,34 @@ void InterruptHandler(void) {
         }
             break;
         case DISK_INTERRUPT_DISK0:
-            RemovePCBInDiskQueue(DISK_INTERRUPT_DISK0-5);
+            osDiskInterrupt(DISK_INTERRUPT_DISK0-DISK_INTERRUPT_DISK0);
             break;
         case DISK_INTERRUPT_DISK1:
-            RemovePCBInDiskQueue(DISK_INTERRUPT_DISK1-5);
+            osDiskInterrupt(DISK_INTERRUPT_DISK1-DISK_INTERRUPT_DISK0);
             break;
             
         case DISK_INTERRUPT_DISK2:
-            RemovePCBInDiskQueue(DISK_INTERRUPT_DISK2-5);
+            osDiskInterrupt(DISK_INTERRUPT_DISK2-DISK_INTERRUPT_DISK0);
             break;
         
         case DISK_INTERRUPT_DISK3:
-            RemovePCBInDiskQueue(DISK_INTERRUPT_DISK3-5);
+            osDiskInterrupt(DISK_INTERRUPT_DISK3-DISK_INTERRUPT_DISK0);
             break;
         
         case DISK_INTERRUPT_DISK4:
-            RemovePCBInDiskQueue(DISK_INTERRUPT_DISK4-5);
+            osDiskInterrupt(DISK_INTERRUPT_DISK4-DISK_INTERRUPT_DISK0);
             break;
         
         case DISK_INTERRUPT_DISK5:
-            RemovePCBInDiskQueue(DISK_INTERRUPT_DISK5-5);
+            osDiskInterrupt(DISK_INTERRUPT_DISK5-DISK_INTERRUPT_DISK0);
             break;
         
         case DISK_INTERRUPT_DISK6:
-            RemovePCBInDiskQueue(DISK_INTERRUPT_DISK6-5);
+            osDiskInterrupt(DISK_INTERRUPT_DISK6-DISK_INTERRUPT_DISK0);
             break;
         
         case DISK_INTERRUPT_DISK7:
-            RemovePCBInDiskQueue(DISK_INTERRUPT_DISK7-5);
+            osDiskInterrupt(DISK_INTERRUPT_DISK7-DISK_INTERRUPT_DISK0);
             break;
         default:
             break;
@@ -556,6 +1053,7 @@ void InterruptHandler(void) {
         aprintf("InterruptHandler: Found device ID %d with status %d\n",
                 DeviceID, Status);
     }
+    InterruptsHandled++;
     
 }           // End of InterruptHandler
 
@@ -565,51 +1063,471 @@ void InterruptHandler(void) {
  ************************************************************************/
 
 
-void osWriteToDisk(INT16 DiskID,INT16 SectorID,char MemoryBuffer[16]){
-    MEMORY_MAPPED_IO mmio;
-    mmio.Mode=Z502DiskWrite;
-    mmio.Field1=DiskID;
-    mmio.Field2=SectorID;
-    mmio.Field3=(long)MemoryBuffer;
-    mmio.Field4=0;
-    MEM_WRITE(Z502Disk, &mmio);
-    
-    mmio.Field2 = DEVICE_IN_USE;
-    while (mmio.Field2 != DEVICE_FREE) {
-        mmio.Mode = Z502Status;
-        mmio.Field1 = DiskID;
-        mmio.Field2 = mmio.Field3 = 0;
-        MEM_READ(Z502Disk, &mmio);
+//Fold a new request into the latest waiting one for the same sector.  A
+//read behind a read rides on it; a read behind a write is answered from
+//the write's buffer at once; a write behind a write replaces its data.
+//A write behind a read has to wait its turn.
+bool osMergeDiskRequest(DiskRequest *request){
+    INT16 DiskID=request->DiskID;
+    DiskRequest *latest=NULL;
+    for(DiskRequest *queued=DiskWaitingHead[DiskID];queued!=NULL;queued=queued->next){
+        if(queued->SectorID==request->SectorID){
+            latest=queued;
+        }
     }
-    
-    INT32 CurrentProcessID=osGetCurrentProcessID();
-    PCB *pcb=GetProcessByID(CurrentProcessID);
-    QInsertOnTail(DiskQueueID, pcb);
-//    osDispatcher();
-    
+    if(latest==NULL || (latest->Mode==Z502DiskRead && request->Mode==Z502DiskWrite)){
+        return false;
+    }
+    DiskMerges[DiskID]++;
+    if(latest->Mode==Z502DiskWrite && request->Mode==Z502DiskRead){
+        memcpy(request->Buffer, latest->Buffer, PGSIZE);
+        request->Done=TRUE;
+        return true;
+    }
+    if(request->Mode==Z502DiskWrite){
+        latest->Buffer=request->Buffer;
+    }
+    request->Merged=latest->Merged;
+    latest->Merged=request;
+    return true;
 }
 
-void osReadOnDisk(INT16 DiskID,INT16 SectorID,char MemoryBuffer[16]){
-    MEMORY_MAPPED_IO mmio;
-    mmio.Mode=Z502DiskRead;
-    mmio.Field1=DiskID;
-    mmio.Field2=SectorID;
-    mmio.Field3=(long)MemoryBuffer;
-    mmio.Field4=0;
-    MEM_WRITE(Z502Disk, &mmio);
+//  Queue a transfer and return at once; the caller waits with osWaitForDisk.
+//  The disk starts it now if idle, otherwise its interrupt starts it later.
+DiskRequest *osStartDiskTransfer(INT16 DiskID,INT16 SectorID,char *MemoryBuffer,INT32 Mode){
+    DiskRequest *request=(DiskRequest *)calloc(1, sizeof(DiskRequest));
+    request->DiskID=DiskID;
+    request->SectorID=SectorID;
+    request->Buffer=MemoryBuffer;
+    request->Mode=Mode;
+    if(DiskID<0 || DiskID>=MAX_NUMBER_OF_DISKS){
+        request->Done=TRUE;
+        return request;
+    }
+    if(QWalk(PCBQueueID, 0)!=(void *)-1){
+        request->Owner=GetProcessByID(osGetCurrentProcessID());
+    }
+    Lock(DiskLockAddress);
+    DiskRequests++;
+    DiskArrivals[DiskID]++;
+//    Queue depth is sampled only for requests that wait on their own, not
+//    for ones folded into a request already waiting
+    if(DiskInFlight[DiskID]==NULL){
+        osIssueDiskRequest(request);
+    }
+    else if(osMergeDiskRequest(request)==false){
+        DiskQueueDepthSum[DiskID]+=DiskQueueLength[DiskID]+1;
+        if(DiskWaitingTail[DiskID]==NULL){
+            DiskWaitingHead[DiskID]=request;
+        }
+        else{
+            DiskWaitingTail[DiskID]->next=request;
+        }
+        DiskWaitingTail[DiskID]=request;
+        DiskQueueLength[DiskID]++;
+        DiskRequestsQueued++;
+    }
+    UnLock(DiskLockAddress);
+    return request;
+}
 
-    mmio.Field2 = DEVICE_IN_USE;
-    while (mmio.Field2 != DEVICE_FREE) {
-        mmio.Mode = Z502Status;
-        mmio.Field1 = DiskID;
-        mmio.Field2 = mmio.Field3 = 0;
-        MEM_READ(Z502Disk, &mmio);
+//  The calling process sleeps until the interrupt for its request, and
+//  other processes run meanwhile.  Inside the dispatcher there is no one
+//  to switch away from, so it idles the CPU until the interrupt instead.
+void osWaitForDisk(DiskRequest *request){
+    PCB *pcb=NULL;
+    if(InDispatcher==false && QWalk(PCBQueueID, 0)!=(void *)-1){
+        pcb=GetProcessByID(osGetCurrentProcessID());
     }
-    
-    INT32 CurrentProcessID=osGetCurrentProcessID();
-    PCB *pcb=GetProcessByID(CurrentProcessID);
-    QInsertOnTail(DiskQueueID, pcb);
-//    osDispatcher();
+    while(request->Done==FALSE){
+        if(pcb==NULL){
+            long handled=InterruptsHandled;
+            if(request->Done==FALSE){
+                osIdleUntilInterrupt(handled);
+            }
+            continue;
+        }
+        bool wait=false;
+        Lock(DiskLockAddress);
+        if(request->Done==FALSE){
+            request->Waiter=pcb;
+            wait=true;
+        }
+        UnLock(DiskLockAddress);
+        if(wait==false){
+            break;
+        }
+        DiskBlockedWaits++;
+        osDispatcher();
+    }
+    free(request);
+}
+
+int BufferHashIndex(INT16 DiskID,INT16 SectorID){
+    return (int)(((UINT32)DiskID*NUMBER_LOGICAL_SECTORS+(UINT32)SectorID)&(BUFFER_CACHE_BUCKETS-1));
+}
+
+bool BufferCacheable(INT16 DiskID,INT16 SectorID){
+    return DiskID>=0 && DiskID<MAX_NUMBER_OF_DISKS && SectorID>=0 && SectorID<NUMBER_LOGICAL_SECTORS;
+}
+
+BufferEntry *BufferCacheLookup(INT16 DiskID,INT16 SectorID){
+    BufferEntry *entry=BufferHash[BufferHashIndex(DiskID, SectorID)];
+    while(entry!=NULL){
+        if(entry->DiskID==DiskID && entry->SectorID==SectorID){
+            return entry;
+        }
+        entry=entry->hashNext;
+    }
+    return NULL;
+}
+
+void BufferHashRemove(BufferEntry *entry){
+    BufferEntry **link=&BufferHash[BufferHashIndex(entry->DiskID, entry->SectorID)];
+    while(*link!=entry){
+        link=&(*link)->hashNext;
+    }
+    *link=entry->hashNext;
+    entry->hashNext=NULL;
+}
+
+void BufferQueueRemove(BufferEntry *entry){
+    BufferQueue *queue=&BufferQueues[entry->Queue];
+    if(entry->prev!=NULL){
+        entry->prev->next=entry->next;
+    }
+    else{
+        queue->Oldest=entry->next;
+    }
+    if(entry->next!=NULL){
+        entry->next->prev=entry->prev;
+    }
+    else{
+        queue->Newest=entry->prev;
+    }
+    entry->prev=entry->next=NULL;
+    queue->Count--;
+}
+
+void BufferQueueAppend(BufferEntry *entry,INT16 Queue){
+    BufferQueue *queue=&BufferQueues[Queue];
+    entry->Queue=Queue;
+    entry->prev=queue->Newest;
+    entry->next=NULL;
+    if(queue->Newest!=NULL){
+        queue->Newest->next=entry;
+    }
+    else{
+        queue->Oldest=entry;
+    }
+    queue->Newest=entry;
+    queue->Count++;
+}
+
+void BufferMarkDirty(BufferEntry *entry){
+    if(entry->Dirty==FALSE){
+        entry->Dirty=TRUE;
+        entry->DirtyTime=Get_CurrentTime();
+        BufferDirtyCount++;
+    }
+}
+
+void BufferMarkClean(BufferEntry *entry){
+    if(entry->Dirty==TRUE){
+        entry->Dirty=FALSE;
+        BufferDirtyCount--;
+    }
+}
+
+//A ghost that is found is used up
+bool BufferGhostTake(INT16 DiskID,INT16 SectorID){
+    INT32 key=DiskID*NUMBER_LOGICAL_SECTORS+SectorID+1;
+    for(int i=0;i<BUFFER_CACHE_GHOSTS;i++){
+        if(BufferGhosts[i]==key){
+            BufferGhosts[i]=0;
+            return true;
+        }
+    }
+    return false;
+}
+
+void BufferGhostAdd(INT16 DiskID,INT16 SectorID){
+    BufferGhosts[BufferGhostNext]=DiskID*NUMBER_LOGICAL_SECTORS+SectorID+1;
+    BufferGhostNext=(BufferGhostNext+1)%BUFFER_CACHE_GHOSTS;
+}
+
+//A hit moves an entry of the main queue to its newest end.  Probation
+//stays in arrival order, so a burst of hits there doesn't promote it.
+void BufferCacheTouch(BufferEntry *entry){
+    BufferCacheHits++;
+    if(entry->Queue==BUFFER_MAIN){
+        BufferQueueRemove(entry);
+        BufferQueueAppend(entry, BUFFER_MAIN);
+    }
+}
+
+//Give a sector an entry, evicting one when the cache is full: under 2Q
+//probation gives one up while it holds more than its share.  The new entry
+//is in place before a dirty victim is written, so the wait there can't
+//let anyone see the victim's sector as missing and unwritten.
+BufferEntry *BufferCacheInsert(INT16 DiskID,INT16 SectorID,char *Data,bool dirty){
+    BufferEntry *entry;
+    char victim[PGSIZE];
+    INT16 victimDisk=-1;
+    INT16 victimSector=0;
+    if(BufferQueues[BUFFER_FREE].Oldest!=NULL){
+        entry=BufferQueues[BUFFER_FREE].Oldest;
+        BufferQueueRemove(entry);
+    }
+    else if(BufferEntriesUsed<BUFFER_CACHE_SECTORS){
+        entry=&BufferEntries[BufferEntriesUsed++];
+    }
+    else{
+        INT16 from=BUFFER_MAIN;
+        if(BUFFER_CACHE_POLICY==BUFFER_CACHE_2Q
+           && (BufferQueues[BUFFER_PROBATION].Count>BUFFER_CACHE_PROBATION || BufferQueues[BUFFER_MAIN].Count==0)){
+            from=BUFFER_PROBATION;
+        }
+        entry=BufferQueues[from].Oldest;
+        BufferQueueRemove(entry);
+        BufferHashRemove(entry);
+        if(from==BUFFER_PROBATION){
+            BufferGhostAdd(entry->DiskID, entry->SectorID);
+        }
+        if(entry->Dirty==TRUE){
+            victimDisk=entry->DiskID;
+            victimSector=entry->SectorID;
+            memcpy(victim, entry->Data, PGSIZE);
+            BufferMarkClean(entry);
+            BufferCacheWriteBacks++;
+        }
+        BufferCacheEvictions++;
+    }
+    entry->DiskID=DiskID;
+    entry->SectorID=SectorID;
+    entry->Dirty=FALSE;
+    memcpy(entry->Data, Data, PGSIZE);
+    if(dirty){
+        BufferMarkDirty(entry);
+    }
+    int bucket=BufferHashIndex(DiskID, SectorID);
+    entry->hashNext=BufferHash[bucket];
+    BufferHash[bucket]=entry;
+    if(BUFFER_CACHE_POLICY==BUFFER_CACHE_2Q && BufferGhostTake(DiskID, SectorID)==false){
+        BufferQueueAppend(entry, BUFFER_PROBATION);
+    }
+    else{
+        BufferQueueAppend(entry, BUFFER_MAIN);
+    }
+    if(victimDisk>=0){
+        osWaitForDisk(osStartDiskTransfer(victimDisk, victimSector, victim, Z502DiskWrite));
+    }
+    return entry;
+}
+
+void IndexCacheForget(INT16 DiskID,INT16 SectorID){
+    for(int i=0;i<INDEX_CACHE_FILES;i++){
+        IndexCacheEntry *cached=&IndexCache[i];
+        if(cached->RootSector==0 || cached->DiskID!=DiskID){
+            continue;
+        }
+        for(int level=0;level<cached->Level;level++){
+            if(cached->NodeSector[level]==SectorID){
+                cached->RootSector=0;
+                break;
+            }
+        }
+    }
+}
+
+void IndexCacheInvalidate(INT16 DiskID){
+    for(int i=0;i<INDEX_CACHE_FILES;i++){
+        if(IndexCache[i].DiskID==DiskID){
+            IndexCache[i].RootSector=0;
+        }
+    }
+}
+
+//The file system reads and writes its sectors through these
+void BufferCacheRead(INT16 DiskID,INT16 SectorID,char MemoryBuffer[PGSIZE]){
+    if(BufferCacheable(DiskID, SectorID)==false){
+        osWaitForDisk(osStartDiskTransfer(DiskID, SectorID, MemoryBuffer, Z502DiskRead));
+        return;
+    }
+    BufferEntry *entry=BufferCacheLookup(DiskID, SectorID);
+    if(entry!=NULL){
+        BufferCacheTouch(entry);
+        memcpy(MemoryBuffer, entry->Data, PGSIZE);
+        return;
+    }
+    BufferCacheMisses++;
+    osWaitForDisk(osStartDiskTransfer(DiskID, SectorID, MemoryBuffer, Z502DiskRead));
+    BufferCacheInsert(DiskID, SectorID, MemoryBuffer, false);
+}
+
+void BufferCacheWrite(INT16 DiskID,INT16 SectorID,char MemoryBuffer[PGSIZE]){
+    if(BufferCacheable(DiskID, SectorID)==false){
+        osWaitForDisk(osStartDiskTransfer(DiskID, SectorID, MemoryBuffer, Z502DiskWrite));
+        return;
+    }
+    IndexCacheForget(DiskID, SectorID);
+    BufferEntry *entry=BufferCacheLookup(DiskID, SectorID);
+    if(entry!=NULL){
+        BufferCacheTouch(entry);
+        memcpy(entry->Data, MemoryBuffer, PGSIZE);
+        BufferMarkDirty(entry);
+        return;
+    }
+//    The whole sector is overwritten, so a miss costs no read
+    BufferCacheMisses++;
+    BufferCacheInsert(DiskID, SectorID, MemoryBuffer, true);
+}
+
+//Write back the dirty sectors of one disk (every disk for -1) that were
+//dirtied no later than DirtyBefore, all at once.  Each is copied and
+//marked clean first, so it may be dirtied again during the writes.
+int BufferCacheFlush(long DiskID,long DirtyBefore){
+    char data[BUFFER_CACHE_SECTORS][PGSIZE];
+    DiskRequest *requests[BUFFER_CACHE_SECTORS];
+    int count=0;
+    for(int i=0;i<BufferEntriesUsed;i++){
+        BufferEntry *entry=&BufferEntries[i];
+        if(entry->Dirty==TRUE && (DiskID==-1 || entry->DiskID==DiskID) && entry->DirtyTime<=DirtyBefore){
+            memcpy(data[count], entry->Data, PGSIZE);
+            BufferMarkClean(entry);
+            requests[count]=osStartDiskTransfer(entry->DiskID, entry->SectorID, data[count], Z502DiskWrite);
+            count++;
+        }
+    }
+    for(int i=0;i<count;i++){
+        osWaitForDisk(requests[i]);
+    }
+    BufferCacheWriteBacks+=count;
+    return count;
+}
+
+int BufferCacheIdleFlush(){
+    int written=BufferCacheFlush(-1, Get_CurrentTime()-BUFFER_CACHE_FLUSH_AGE);
+    if(written>0){
+        BufferCacheIdleFlushes++;
+    }
+    return written;
+}
+
+bool BitMapTest(INT16 DiskID,int SectorID){
+    return (BitMap[DiskID][SectorID/64]>>(SectorID%64)&1)!=0;
+}
+
+void ModifyBitMap(long DiskID,long SectorID){
+    int word=SectorID/64;
+    BitMap[DiskID][word]|=1ULL<<(SectorID%64);
+    BitMapDirtySectors[DiskID]|=1u<<(word/BITMAP_WORDS_PER_SECTOR);
+}
+
+//First free sector from the hint on, a word at a time.  Nothing is ever
+//freed below the hint, so this finds what a scan from sector 0 would.
+int findAvailableSector(short DiskID){
+    for(int n=0;n<BITMAP_WORDS;n++){
+        int word=(BitMapHint[DiskID]+n)%BITMAP_WORDS;
+        if(~BitMap[DiskID][word]!=0){
+            BitMapHint[DiskID]=word;
+            return word*64+__builtin_ctzll(~BitMap[DiskID][word]);
+        }
+    }
+    return 0;
+}
+
+//Save the changed bitmap sectors of formatted disks (all disks for -1).
+//They go through the buffer cache, so a burst of allocations costs one
+//disk write per bitmap sector when it is written back.
+void BitMapFlush(long DiskID){
+    for(int disk=0;disk<MAX_NUMBER_OF_DISKS;disk++){
+        if((DiskID!=-1 && disk!=DiskID) || BitMapOnDisk[disk]==false){
+            continue;
+        }
+        while(BitMapDirtySectors[disk]!=0){
+            int sector=__builtin_ctz(BitMapDirtySectors[disk]);
+            BitMapDirtySectors[disk]&=~(1u<<sector);
+            unsigned char block[PGSIZE];
+            for(int w=0;w<BITMAP_WORDS_PER_SECTOR;w++){
+                unsigned long long bits=BitMap[disk][sector*BITMAP_WORDS_PER_SECTOR+w];
+                for(int b=0;b<8;b++){
+                    block[w*8+b]=(bits>>(8*b))&255;
+                }
+            }
+            BufferCacheWrite(disk, BITMAP_LOCATION+sector, (char *)block);
+        }
+    }
+}
+
+//Mounting a disk formatted earlier reads its bitmap back from where
+//sector 0 says it is.  What swap has claimed meanwhile is kept.
+void BitMapLoad(INT16 DiskID){
+    unsigned char block[PGSIZE];
+    BufferCacheRead(DiskID, 0, (char *)block);
+    int Location=block[7]*256+block[6];
+    if(Location==0 || block[1]!=BITMAP_SIZE_FIELD){
+        return;
+    }
+    for(int sector=0;sector<BITMAP_SECTORS;sector++){
+        BufferCacheRead(DiskID, Location+sector, (char *)block);
+        for(int w=0;w<BITMAP_WORDS_PER_SECTOR;w++){
+            unsigned long long bits=0;
+            for(int b=0;b<8;b++){
+                bits|=(unsigned long long)block[w*8+b]<<(8*b);
+            }
+            BitMap[DiskID][sector*BITMAP_WORDS_PER_SECTOR+w]|=bits;
+        }
+    }
+    BitMapHint[DiskID]=0;
+    BitMapOnDisk[DiskID]=true;
+}
+
+//SYNC_DISK
+void BufferCacheSync(long DiskID,long *Result){
+    if(DiskID<-1 || DiskID>=MAX_NUMBER_OF_DISKS){
+        *Result=ERR_BAD_PARAM;
+        return;
+    }
+    KernelMutexAcquire(&FileSystemMutex);
+    BitMapFlush(DiskID);
+    BufferCacheFlush(DiskID, Get_CurrentTime());
+    KernelMutexRelease(&FileSystemMutex);
+    *Result=ERR_SUCCESS;
+}
+
+//Formatting starts the disk over, cached sectors and all
+void BufferCacheInvalidate(INT16 DiskID){
+    for(int i=0;i<BufferEntriesUsed;i++){
+        BufferEntry *entry=&BufferEntries[i];
+        if(entry->Queue!=BUFFER_FREE && entry->DiskID==DiskID){
+            BufferQueueRemove(entry);
+            BufferHashRemove(entry);
+            BufferMarkClean(entry);
+            BufferQueueAppend(entry, BUFFER_FREE);
+        }
+    }
+}
+
+//Physical transfers go around the buffer cache but keep it coherent: a
+//read takes the cached copy if there is one, and a write refreshes it.
+void osWriteToDisk(INT16 DiskID,INT16 SectorID,char MemoryBuffer[PGSIZE]){
+    IndexCacheForget(DiskID, SectorID);
+    BufferEntry *entry=BufferCacheLookup(DiskID, SectorID);
+    if(entry!=NULL){
+        memcpy(entry->Data, MemoryBuffer, PGSIZE);
+        BufferMarkClean(entry);
+    }
+    osWaitForDisk(osStartDiskTransfer(DiskID, SectorID, MemoryBuffer, Z502DiskWrite));
+}
+
+void osReadOnDisk(INT16 DiskID,INT16 SectorID,char MemoryBuffer[PGSIZE]){
+    BufferEntry *entry=BufferCacheLookup(DiskID, SectorID);
+    if(entry!=NULL){
+        memcpy(MemoryBuffer, entry->Data, PGSIZE);
+        return;
+    }
+    osWaitForDisk(osStartDiskTransfer(DiskID, SectorID, MemoryBuffer, Z502DiskRead));
 }
 
 void osCheckDisk(long DiskID,long *Result){
@@ -618,6 +1536,8 @@ void osCheckDisk(long DiskID,long *Result){
         *Result=ERR_BAD_PARAM;;
     }
     else{
+//        The check sees what the file system has written so far
+        BufferCacheFlush(DiskID, Get_CurrentTime());
         mmio.Mode=Z502CheckDisk;
         mmio.Field1=DiskID;
         mmio.Field2=mmio.Field3=mmio.Field4=0;
@@ -629,122 +1549,1320 @@ void osCheckDisk(long DiskID,long *Result){
 
 
 
-int getPhysicalFrame(){
+int getPhysicalFrame(){
+    for(int i=0;i<NUMBER_PHYSICAL_PAGES;i++){
+        if(Frame[i].InUse==FALSE){
+            return i;
+        }
+    }
+    return -1;
+}
+
+
+//Page directories start out empty; leaf tables appear as pages are touched
+UINT16 **AllocatePageDirectory(){
+    return (UINT16 **)calloc(PTBL_DIRECTORY_ENTRIES, sizeof(UINT16 *));
+}
+
+//Find the page table entry for a page.  With allocate set, a missing leaf
+//table is created; otherwise NULL means no page in that leaf was ever touched.
+UINT16 *GetPTE(PCB *pcb,int pageNo,bool allocate){
+    if(pageNo<0 || pageNo>=NUMBER_VIRTUAL_PAGES){
+        return NULL;
+    }
+    UINT16 **directory=pcb->Pagetable;
+    int leaf=pageNo/PTBL_LEAF_ENTRIES;
+    if(directory[leaf]==NULL){
+        if(allocate==false){
+            return NULL;
+        }
+        directory[leaf]=(UINT16 *)calloc(PTBL_LEAF_ENTRIES, sizeof(UINT16));
+        pcb->PageTableLeaves++;
+    }
+    return &directory[leaf][pageNo%PTBL_LEAF_ENTRIES];
+}
+
+//Give back a dead process's directory and every leaf table it grew
+void FreePageTable(PCB *pcb){
+    UINT16 **directory=pcb->Pagetable;
+    if(directory==NULL){
+        return;
+    }
+    for(int leaf=0;leaf<PTBL_DIRECTORY_ENTRIES;leaf++){
+        free(directory[leaf]);
+    }
+    free(directory);
+    pcb->Pagetable=NULL;
+    pcb->PageTableLeaves=0;
+}
+
+//A prefetched frame only counts as used once the hardware has referenced it
+void checkPrefetchedFrame(int frame){
+    if(Frame[frame].Prefetched!=0 && (*Frame[frame].PTE&PTBL_REFERENCED_BIT)!=0){
+        Frame[frame].Prefetched=0;
+        Frame[frame].State=Frame[frame].State|FRAME_REFERENCED;
+        PrefetchHits++;
+    }
+}
+
+//The Page Selection Algorithms is based on second-chance algorithms
+int getVictimFrames(PCB *pcb){
+    int victimframes=-1;
+    while(true){
+        for(int i=0;i<NUMBER_PHYSICAL_PAGES;i++){
+            if(Frame[i].Pid==pcb->processID && Frame[i].Shared==NULL){
+                checkPrefetchedFrame(i);
+                if((Frame[i].State&FRAME_REFERENCED)==0){
+                    victimframes=i;
+                    break;
+                }
+                else{
+                    Frame[i].State=Frame[i].State-1;
+                }
+            }
+        }
+        if(victimframes!=-1){
+            break;
+        }
+    }
+    return victimframes;
+}
+
+int SwapHashIndex(INT32 ProcessID,int pageNo){
+    return (int)(((UINT32)ProcessID*SWAP_HASH_MULTIPLIER+(UINT32)pageNo)&(SWAP_HASH_BUCKETS-1));
+}
+
+SwapEntry *SwapLookup(INT32 ProcessID,int pageNo){
+    SwapEntry *entry=SwapHash[SwapHashIndex(ProcessID, pageNo)];
+    while(entry!=NULL){
+        if(entry->ProcessID==ProcessID && entry->virtualPage==pageNo){
+            return entry;
+        }
+        entry=entry->next;
+    }
+    return NULL;
+}
+
+SwapEntry *SwapInsert(INT32 ProcessID,int pageNo,short SectorID){
+    SwapEntry *entry;
+    if(SwapEntryFreeList==NULL){
+//        Grow the pool of entries a chunk at a time rather than one by one
+        SwapEntry *chunk=(SwapEntry *)calloc(SWAP_ENTRY_CHUNK, sizeof(SwapEntry));
+        for(int i=0;i<SWAP_ENTRY_CHUNK;i++){
+            chunk[i].next=SwapEntryFreeList;
+            SwapEntryFreeList=&chunk[i];
+        }
+    }
+    entry=SwapEntryFreeList;
+    SwapEntryFreeList=entry->next;
+    int bucket=SwapHashIndex(ProcessID, pageNo);
+    entry->ProcessID=ProcessID;
+    entry->virtualPage=pageNo;
+    entry->DiskID=-1;
+    entry->SectorID=SectorID;
+    entry->CopyValid=FALSE;
+    entry->Cached=NULL;
+    entry->next=SwapHash[bucket];
+    SwapHash[bucket]=entry;
+    return entry;
+}
+
+void SwapDelete(INT32 ProcessID,int pageNo){
+    SwapEntry **link=&SwapHash[SwapHashIndex(ProcessID, pageNo)];
+    while(*link!=NULL){
+        SwapEntry *entry=*link;
+        if(entry->ProcessID==ProcessID && entry->virtualPage==pageNo){
+            *link=entry->next;
+            entry->next=SwapEntryFreeList;
+            SwapEntryFreeList=entry;
+            return;
+        }
+        link=&entry->next;
+    }
+}
+
+short AllocateSwapSlotOnDisk(INT16 DiskID){
+    if(SwapFreeSlotCount[DiskID]>0){
+        SwapFreeSlotCount[DiskID]--;
+        return SwapFreeSlots[DiskID][SwapFreeSlotCount[DiskID]];
+    }
+//    Skip anything the file system has already claimed on this disk, and
+//    the sectors a format would put sector 0, the root and the bitmap in
+    if(SwapNextSector[DiskID]<SWAP_FIRST_SECTOR){
+        SwapNextSector[DiskID]=SWAP_FIRST_SECTOR;
+    }
+    while(SwapNextSector[DiskID]<NUMBER_LOGICAL_SECTORS && BitMapTest(DiskID, SwapNextSector[DiskID])){
+        SwapNextSector[DiskID]++;
+    }
+    if(SwapNextSector[DiskID]>=NUMBER_LOGICAL_SECTORS){
+        return -1;
+    }
+    short SectorID=SwapNextSector[DiskID];
+    SwapNextSector[DiskID]++;
+    ModifyBitMap(DiskID, SectorID);
+    return SectorID;
+}
+
+//  Successive slots go to successive swap disks, so that a batch of
+//  page-outs or page-ins can keep all of them busy at once.
+short AllocateSwapSlot(INT16 *DiskID){
+    for(int tries=0;tries<SWAP_DISK_COUNT;tries++){
+        INT16 disk=SWAP_DISK+SwapNextDisk;
+        SwapNextDisk=(SwapNextDisk+1)%SWAP_DISK_COUNT;
+        short SectorID=AllocateSwapSlotOnDisk(disk);
+        if(SectorID>=0){
+            *DiskID=disk;
+            return SectorID;
+        }
+    }
+    aprintf("AllocateSwapSlot: the swap disks are full\n");
+    return -1;
+}
+
+void ReleaseSwapSlot(INT16 DiskID,short SectorID){
+    if(SwapFreeSlotCount[DiskID]==SwapFreeSlotCapacity[DiskID]){
+        SwapFreeSlotCapacity[DiskID]=(SwapFreeSlotCapacity[DiskID]==0)?SWAP_ENTRY_CHUNK:SwapFreeSlotCapacity[DiskID]*2;
+        SwapFreeSlots[DiskID]=(short *)realloc(SwapFreeSlots[DiskID], SwapFreeSlotCapacity[DiskID]*sizeof(short));
+    }
+    SwapFreeSlots[DiskID][SwapFreeSlotCount[DiskID]]=SectorID;
+    SwapFreeSlotCount[DiskID]++;
+}
+
+//  Batches are kept in (disk, sector) order so each disk sweeps one way
+bool SwapSlotBefore(SwapEntry *a,SwapEntry *b){
+    if(a->DiskID!=b->DiskID){
+        return a->DiskID<b->DiskID;
+    }
+    return a->SectorID<b->SectorID;
+}
+
+//  Run a batch of swap transfers.  Every request is queued on its disk at
+//  once, so transfers on different disks overlap, and the caller sleeps
+//  until the last of them is done.
+void SwapTransferBatch(SwapEntry **batch,char (*buffers)[PGSIZE],int count,INT32 Mode){
+    DiskRequest *requests[SWAP_CACHE_SPILL_BATCH>FAULT_AROUND_MAX_PAGES?SWAP_CACHE_SPILL_BATCH:FAULT_AROUND_MAX_PAGES];
+    if(count==0){
+        return;
+    }
+    for(int i=0;i<count;i++){
+        requests[i]=osStartDiskTransfer(batch[i]->DiskID, batch[i]->SectorID, buffers[i], Mode);
+        SwapTransfers++;
+    }
+    for(int i=0;i<count;i++){
+        osWaitForDisk(requests[i]);
+    }
+    SwapTransferBatches++;
+}
+
+bool isPageInDisk(INT32 ProcessID,int pageNo){
+    return SwapLookup(ProcessID, pageNo)!=NULL;
+}
+
+
+//  Each cached page costs its compressed words plus a small header
+int SwapCacheCost(SwapCacheEntry *cached){
+    return cached->Length+SWAP_CACHE_HEADER_BYTES;
+}
+
+void SwapCacheCompress(char *page,SwapCacheEntry *cached){
+    INT32 words[PGSIZE/4];
+    INT32 kept[PGSIZE/4];
+    memcpy(words, page, PGSIZE);
+    memset(cached->WordMask, 0, sizeof(cached->WordMask));
+    cached->Length=0;
+    for(int i=0;i<PGSIZE/4;i++){
+        if(words[i]!=0){
+            cached->WordMask[i/8]|=1<<(i%8);
+            kept[cached->Length/4]=words[i];
+            cached->Length+=4;
+        }
+    }
+    cached->Data=NULL;
+    if(cached->Length>0){
+        cached->Data=(char *)malloc(cached->Length);
+        memcpy(cached->Data, kept, cached->Length);
+    }
+}
+
+void SwapCacheDecompress(SwapCacheEntry *cached,char *page){
+    INT32 words[PGSIZE/4];
+    int used=0;
+    for(int i=0;i<PGSIZE/4;i++){
+        words[i]=0;
+        if((cached->WordMask[i/8]&(1<<(i%8)))!=0){
+            memcpy(&words[i], cached->Data+used, 4);
+            used+=4;
+        }
+    }
+    memcpy(page, words, PGSIZE);
+}
+
+void SwapCacheRemove(SwapEntry *entry){
+    SwapCacheEntry *cached=entry->Cached;
+    if(cached->prev!=NULL){
+        cached->prev->next=cached->next;
+    }
+    else{
+        SwapCacheOldest=cached->next;
+    }
+    if(cached->next!=NULL){
+        cached->next->prev=cached->prev;
+    }
+    else{
+        SwapCacheNewest=cached->prev;
+    }
+    SwapCacheUsed-=SwapCacheCost(cached);
+    free(cached->Data);
+    free(cached);
+    entry->Cached=NULL;
+}
+
+//Throw away a page's swap copy, cached or on disk, when the page is replaced
+void SwapDiscard(INT32 ProcessID,int pageNo){
+    SwapEntry *entry=SwapLookup(ProcessID, pageNo);
+    if(entry==NULL){
+        return;
+    }
+    if(entry->Cached!=NULL){
+        SwapCacheRemove(entry);
+    }
+    if(entry->SectorID>=0){
+        ReleaseSwapSlot(entry->DiskID, entry->SectorID);
+    }
+    SwapDelete(ProcessID, pageNo);
+}
+
+//  Write the oldest cached pages out to the swap disk, a batch at a time
+//  and in sector order, until the cache is back under its budget.
+void SpillSwapCache(){
+    while(SwapCacheUsed>SWAP_CACHE_BYTES && SwapCacheOldest!=NULL){
+        SwapEntry *batch[SWAP_CACHE_SPILL_BATCH];
+        int count=0;
+        SwapCacheEntry *cached=SwapCacheOldest;
+        while(cached!=NULL && count<SWAP_CACHE_SPILL_BATCH){
+            SwapEntry *entry=cached->owner;
+            cached=cached->next;
+            if(entry->SectorID<0){
+                entry->SectorID=AllocateSwapSlot(&entry->DiskID);
+                if(entry->SectorID<0){
+                    break;
+                }
+            }
+            int slot=count;
+            while(slot>0 && SwapSlotBefore(entry, batch[slot-1])){
+                batch[slot]=batch[slot-1];
+                slot--;
+            }
+            batch[slot]=entry;
+            count++;
+        }
+        if(count==0){
+            return;
+        }
+        char diskwrite[SWAP_CACHE_SPILL_BATCH][PGSIZE];
+        for(int i=0;i<count;i++){
+            SwapCacheDecompress(batch[i]->Cached, diskwrite[i]);
+        }
+        SwapTransferBatch(batch, diskwrite, count, Z502DiskWrite);
+        for(int i=0;i<count;i++){
+            batch[i]->CopyValid=TRUE;
+            SwapCacheRemove(batch[i]);
+            SwapCacheSpills++;
+        }
+    }
+}
+
+void SwapCacheStore(SwapEntry *entry,char *page){
+    if(entry->Cached!=NULL){
+        SwapCacheRemove(entry);
+    }
+    SwapCacheEntry *cached=(SwapCacheEntry *)calloc(1, sizeof(SwapCacheEntry));
+    SwapCacheCompress(page, cached);
+    cached->owner=entry;
+    cached->prev=SwapCacheNewest;
+    if(SwapCacheNewest!=NULL){
+        SwapCacheNewest->next=cached;
+    }
+    else{
+        SwapCacheOldest=cached;
+    }
+    SwapCacheNewest=cached;
+    entry->Cached=cached;
+    SwapCacheUsed+=SwapCacheCost(cached);
+    SwapCacheBytesIn+=PGSIZE;
+    SwapCacheBytesStored+=SwapCacheCost(cached);
+    if(SwapCacheUsed>SWAP_CACHE_BYTES){
+        SpillSwapCache();
+    }
+}
+
+//  Demand-zero: a page that has never been evicted starts out as zeros,
+//  not as whatever the frame's previous owner left behind.
+void ZeroFillFrame(int physicalframes){
+    char zeroPage[PGSIZE];
+    memset(zeroPage, 0, PGSIZE);
+    Z502WritePhysicalMemory(physicalframes, zeroPage);
+}
+
+//  The swap slot is kept after a page-in so that, if the page is never
+//  written, the eviction can simply drop it.  A page found in the swap
+//  cache leaves it, since the frame now holds the only live copy.
+void ReadVirtualPagetoMemory(int physicalframes,int pageNo,int pid){
+    char diskread[PGSIZE];
+    for(int i=0;i<PGSIZE;i++){
+        diskread[i]=0;
+    }
+    SwapEntry *entry=SwapLookup(pid, pageNo);
+    if(entry!=NULL && entry->Cached!=NULL){
+        SwapCacheDecompress(entry->Cached, diskread);
+        Z502WritePhysicalMemory(physicalframes, diskread);
+        SwapCacheRemove(entry);
+        SwapCacheHits++;
+    }
+    else if(entry!=NULL){
+        SwapCacheMisses++;
+        SwapTransferBatch(&entry, (char (*)[PGSIZE])diskread, 1, Z502DiskRead);
+        Z502WritePhysicalMemory(physicalframes, diskread);
+        entry->CopyValid=TRUE;
+    }
+}
+
+
+//Drop a page's translation from the TLB of every processor
+void osFlushTLBEntry(PCB *pcb,int pageNo){
+    MEMORY_MAPPED_IO mmio;
+    if(TLBEntries==0){
+        return;
+    }
+    mmio.Mode=Z502FlushTLBEntry;
+    mmio.Field1=pcb->currentContext;
+    mmio.Field2=pageNo;
+    mmio.Field3=mmio.Field4=0;
+    MEM_WRITE(Z502TLB, &mmio);
+}
+
+FileMapping *FindFileMapping(PCB *pcb,int pageNo){
+    for(FileMapping *mapping=FileMappings;mapping!=NULL;mapping=mapping->next){
+        if(mapping->Owner==pcb && pageNo>=mapping->StartPage && pageNo<mapping->StartPage+mapping->Pages){
+            return mapping;
+        }
+    }
+    return NULL;
+}
+
+//Move one page between a frame and its block of a mapped file
+void TransferMappedPage(FileMapping *mapping,int pageNo,int physicalframes,INT32 Mode){
+    char block[PGSIZE];
+    short SectorID=mapping->Sectors[pageNo-mapping->StartPage];
+    if(Mode==Z502DiskWrite){
+        Z502ReadPhysicalMemory(physicalframes, block);
+        osWriteToDisk(mapping->DiskID, SectorID, block);
+    }
+    else{
+        osReadOnDisk(mapping->DiskID, SectorID, block);
+        Z502WritePhysicalMemory(physicalframes, block);
+    }
+}
+
+//Save one mapping's copy of a frame, unless its swap copy is still good.
+//A page of a mapped file goes back to the file instead, and only if dirty.
+void writePageToSwap(int victimframes,PCB *owner,int victimVitualPageNo,UINT16 *pte){
+    char diskread[PGSIZE];
+    INT32 pid=owner->processID;
+    SwapEntry *entry=SwapLookup(pid, victimVitualPageNo);
+    bool modified=(*pte&PTBL_MODIFIED_BIT)!=0;
+//    The write below may block, and the page must not change under it
+    *pte&=~PTBL_VALID_BIT;
+    osFlushTLBEntry(owner, victimVitualPageNo);
+    FileMapping *mapping=FindFileMapping(owner, victimVitualPageNo);
+    if(mapping!=NULL){
+        if(modified){
+            TransferMappedPage(mapping, victimVitualPageNo, victimframes, Z502DiskWrite);
+            FileWritebacks++;
+        }
+        else{
+            CleanEvictions++;
+        }
+        return;
+    }
+    if(entry!=NULL && entry->CopyValid==TRUE && modified==false){
+        CleanEvictions++;
+        return;
+    }
+    for(int i=0;i<PGSIZE;i++){
+        diskread[i]=0;
+    }
+    Z502ReadPhysicalMemory(victimframes, diskread);
+    if(entry==NULL){
+        entry=SwapInsert(pid, victimVitualPageNo, -1);
+    }
+//    The page goes to the swap cache; it reaches the disk only if it is spilled
+    entry->CopyValid=FALSE;
+    SwapCacheStore(entry, diskread);
+    DirtyEvictions++;
+}
+
+//A merged frame's other mappings each get their own swap copy and lose
+//their translation first; then the owner's copy is saved.
+void writeVictimToDisk(int victimframes){
+    while(Frame[victimframes].Merged!=NULL){
+        MergeMapping *mapping=Frame[victimframes].Merged;
+        writePageToSwap(victimframes, mapping->Owner, mapping->LogicalPage, mapping->PTE);
+        *mapping->PTE=PTBL_SWAPPED_BIT;
+        osFlushTLBEntry(mapping->Owner, mapping->LogicalPage);
+        Frame[victimframes].Merged=mapping->next;
+        free(mapping);
+        MergedPages--;
+    }
+    writePageToSwap(victimframes, Frame[victimframes].Owner, Frame[victimframes].LogicalPage, Frame[victimframes].PTE);
+}
+
+void resetPhysicalFrame(int physicalframes){
+    if(Frame[physicalframes].InUse==TRUE){
+        FreeFrameCount++;
+    }
+    Frame[physicalframes].InUse=false;
+    Frame[physicalframes].Pid=-1;
+    Frame[physicalframes].State=-1;
+    Frame[physicalframes].LogicalPage=-1;
+    Frame[physicalframes].Prefetched=0;
+    Frame[physicalframes].Owner=NULL;
+    Frame[physicalframes].PTE=NULL;
+    Frame[physicalframes].Shared=NULL;
+    Frame[physicalframes].Merged=NULL;
+}
+
+//Map a frame into a process and count it in that process's resident set
+void assignFrame(int physicalframes,PCB *pcb,int pageNo,short PTEBits,INT16 State){
+    UINT16 *pte=GetPTE(pcb, pageNo, true);
+    *pte=PTEBits|physicalframes;
+    if(Frame[physicalframes].InUse==FALSE){
+        FreeFrameCount--;
+    }
+    Frame[physicalframes].InUse=TRUE;
+    Frame[physicalframes].Pid=pcb->processID;
+    Frame[physicalframes].LogicalPage=pageNo;
+    Frame[physicalframes].State=State;
+    Frame[physicalframes].Prefetched=0;
+    Frame[physicalframes].Owner=pcb;
+    Frame[physicalframes].PTE=pte;
+    pcb->ResidentFrames++;
+}
+
+//Take a frame away from its owner, invalidating the owner's page table entry
+//The PTE keeps PTBL_SWAPPED_BIT if the page has a copy on the swap disk,
+//so the next fault knows whether to read it back or zero-fill.
+void releaseFrame(int physicalframes){
+    PCB *owner=Frame[physicalframes].Owner;
+    int page=Frame[physicalframes].LogicalPage;
+    if(isPageInDisk(owner->processID, page)){
+        *Frame[physicalframes].PTE=PTBL_SWAPPED_BIT;
+    }
+    else{
+        *Frame[physicalframes].PTE=0;
+    }
+    osFlushTLBEntry(owner, page);
+    owner->ResidentFrames--;
+    resetPhysicalFrame(physicalframes);
+}
+
+//Prefetching only uses frames that are free anyway, and leaves the
+//page-out daemon's reserve for demand faults.  It never evicts a page.
+int getPrefetchFrame(PCB *pcb){
+    if(FreeFrameCount<=PAGEOUT_LOW_WATERMARK){
+        return -1;
+    }
+    return getPhysicalFrame();
+}
+
+//Grow the window while faults walk forward through the address space,
+//and shrink it when they jump around.
+int adjustFaultAroundWindow(PCB *pcb,int pageNo){
+    int distance=pageNo-pcb->LastFaultPage;
+    if(distance>0 && distance<=pcb->FaultAroundWindow+1){
+        pcb->FaultAroundWindow=(pcb->FaultAroundWindow==0)?1:pcb->FaultAroundWindow*2;
+        if(pcb->FaultAroundWindow>FAULT_AROUND_MAX_PAGES){
+            pcb->FaultAroundWindow=FAULT_AROUND_MAX_PAGES;
+        }
+    }
+    else{
+        pcb->FaultAroundWindow=pcb->FaultAroundWindow/2;
+    }
+    pcb->LastFaultPage=pageNo;
+    return pcb->FaultAroundWindow;
+}
+
+//Bring in the swapped-out pages that follow the faulting page.  The reads
+//are issued back to back in sector order so the disk head sweeps once.
+//Prefetched pages are mapped without the referenced bit so the replacer
+//takes them first if they turn out to be useless.
+void FaultAround(PCB *pcb,int pageNo){
+    int window=adjustFaultAroundWindow(pcb, pageNo);
+    SwapEntry *batch[FAULT_AROUND_MAX_PAGES];
+    int count=0;
+    for(int page=pageNo+1;page<=pageNo+window && page<NUMBER_VIRTUAL_PAGES;page++){
+        UINT16 *pte=GetPTE(pcb, page, false);
+        if(pte==NULL || (*pte&PTBL_VALID_BIT)!=0 || (*pte&PTBL_SWAPPED_BIT)==0){
+            continue;
+        }
+        SwapEntry *entry=SwapLookup(pcb->processID, page);
+        if(entry==NULL || entry->CopyValid==FALSE){
+            continue;
+        }
+        int slot=count;
+        while(slot>0 && SwapSlotBefore(entry, batch[slot-1])){
+            batch[slot]=batch[slot-1];
+            slot--;
+        }
+        batch[slot]=entry;
+        count++;
+    }
+    PrefetchBatch++;
+//    Claim every frame first, so the reads can all be in flight together
+    int frames[FAULT_AROUND_MAX_PAGES];
+    for(int i=0;i<count;i++){
+        frames[i]=getPrefetchFrame(pcb);
+        if(frames[i]==-1){
+            count=i;
+            break;
+        }
+        assignFrame(frames[i], pcb, batch[i]->virtualPage, PTBL_VALID_BIT, FRAME_VALID);
+        Frame[frames[i]].Prefetched=PrefetchBatch;
+    }
+    char diskread[FAULT_AROUND_MAX_PAGES][PGSIZE];
+    SwapTransferBatch(batch, diskread, count, Z502DiskRead);
+    for(int i=0;i<count;i++){
+        Z502WritePhysicalMemory(frames[i], diskread[i]);
+        PrefetchedPages++;
+    }
+}
+
+//Page-fault-frequency control.  Faults are counted over windows of
+//simulation time; a process faulting too often is given more frames and
+//one faulting rarely gives some back.
+void UpdateFaultFrequency(PCB *pcb){
+    long CurrentTime=Get_CurrentTime();
+    pcb->PageFaults++;
+    if(pcb->FrameAllocation==0){
+        pcb->FrameAllocation=NUMBER_PHYSICAL_PAGES/Get_Num_Process();
+        if(pcb->FrameAllocation<PFF_MIN_FRAMES){
+            pcb->FrameAllocation=PFF_MIN_FRAMES;
+        }
+        pcb->FaultWindowStart=CurrentTime;
+        pcb->FaultsInWindow=0;
+    }
+    pcb->FaultsInWindow++;
+    if(CurrentTime-pcb->FaultWindowStart<PFF_WINDOW){
+        return;
+    }
+    long rate=pcb->FaultsInWindow*PFF_WINDOW/(CurrentTime-pcb->FaultWindowStart);
+    if(rate>PFF_UPPER_THRESHOLD){
+        pcb->FrameAllocation+=PFF_STEP;
+        if(pcb->FrameAllocation>NUMBER_PHYSICAL_PAGES){
+            pcb->FrameAllocation=NUMBER_PHYSICAL_PAGES;
+        }
+    }
+    if(rate<PFF_LOWER_THRESHOLD){
+        pcb->FrameAllocation-=PFF_STEP;
+        if(pcb->FrameAllocation<PFF_MIN_FRAMES){
+            pcb->FrameAllocation=PFF_MIN_FRAMES;
+        }
+    }
+    pcb->FaultWindowStart=CurrentTime;
+    pcb->FaultsInWindow=0;
+}
+
+//A process within its allocation replaces its own pages.  One below it
+//takes a frame from whoever is furthest above theirs.
+PCB *selectVictimProcess(PCB *pcb){
+    if(pcb->ResidentFrames>=pcb->FrameAllocation && pcb->ResidentFrames>0){
+        return pcb;
+    }
+    PCB *victim=NULL;
+    PCB *largest=NULL;
+    int excess=0;
+    int i=0;
+    while((int)QWalk(PCBQueueID,i)!=-1){
+        PCB *candidate=QWalk(PCBQueueID, i);
+        if(candidate!=pcb && candidate->ResidentFrames-candidate->FrameAllocation>excess){
+            excess=candidate->ResidentFrames-candidate->FrameAllocation;
+            victim=candidate;
+        }
+        if(largest==NULL || candidate->ResidentFrames>largest->ResidentFrames){
+            largest=candidate;
+        }
+        i++;
+    }
+    if(victim!=NULL){
+        return victim;
+    }
+    if(pcb->ResidentFrames>0){
+        return pcb;
+    }
+    return largest;
+}
+
+//One sweep of the page-out clock.  Referenced frames get a second chance;
+//the first unreferenced one is evicted, written back only if it is dirty.
+//The first lap only looks at processes holding more than their allocation.
+bool PageOutOneFrame(bool cleanOnly){
+    for(int step=0;step<3*NUMBER_PHYSICAL_PAGES;step++){
+        int i=PageOutHand;
+        PageOutHand=(PageOutHand+1)%NUMBER_PHYSICAL_PAGES;
+        if(Frame[i].InUse==FALSE || Frame[i].Shared!=NULL){
+            continue;
+        }
+        PCB *owner=Frame[i].Owner;
+        if(step<NUMBER_PHYSICAL_PAGES && owner->ResidentFrames<=owner->FrameAllocation){
+            continue;
+        }
+        checkPrefetchedFrame(i);
+        if((Frame[i].State&FRAME_REFERENCED)!=0){
+            Frame[i].State=Frame[i].State&~FRAME_REFERENCED;
+            continue;
+        }
+        int page=Frame[i].LogicalPage;
+        if(cleanOnly){
+            SwapEntry *entry=SwapLookup(owner->processID, page);
+            if(entry==NULL || entry->CopyValid==FALSE || (*Frame[i].PTE&PTBL_MODIFIED_BIT)!=0 || Frame[i].Merged!=NULL){
+                continue;
+            }
+        }
+        if(Frame[i].Prefetched!=0){
+            WastedPrefetches++;
+        }
+        writeVictimToDisk(i);
+        releaseFrame(i);
+        DaemonEvictions++;
+        return true;
+    }
+    return false;
+}
+
+//Refill the free pool up to the high watermark.  This is a deferred task:
+//it runs once a fault has been serviced and the pager released, if the pool
+//has dropped below the low watermark, and (clean pages first) while the
+//dispatcher is idle.  Later faults then find a free frame waiting.
+//Returns the number of frames it freed.
+int PageOutDaemon(int cleanOnly){
+    int freed=0;
+    while(FreeFrameCount<PAGEOUT_HIGH_WATERMARK){
+        if(PageOutOneFrame(cleanOnly)==false){
+            break;
+        }
+        freed++;
+    }
+    return freed;
+}
+
+//Find a frame for pcb, evicting a page of the victim process if none is free
+int obtainFrame(PCB *pcb){
+    int physicalframes=getPhysicalFrame();
+    if(physicalframes!=-1){
+        return physicalframes;
+    }
+    PCB *victimpcb=selectVictimProcess(pcb);
+    int victimframes=getVictimFrames(victimpcb);
+    if(Frame[victimframes].Prefetched!=0){
+        WastedPrefetches++;
+    }
+    writeVictimToDisk(victimframes);
+    releaseFrame(victimframes);
+    return victimframes;
+}
+
+//Hash a page a word at a time (FNV-1a over 32 bit words)
+UINT32 HashPage(char *page){
+    UINT32 words[PGSIZE/4];
+    UINT32 hash=2166136261u;
+    memcpy(words, page, PGSIZE);
+    for(int i=0;i<PGSIZE/4;i++){
+        hash=(hash^words[i])*16777619u;
+    }
+    return hash;
+}
+
+//Point another PTE at a merged frame, read only
+void addMergeMapping(int frame,PCB *owner,int page,UINT16 *pte){
+    MergeMapping *mapping=(MergeMapping *)calloc(1, sizeof(MergeMapping));
+    mapping->Owner=owner;
+    mapping->LogicalPage=page;
+    mapping->PTE=pte;
+    mapping->next=Frame[frame].Merged;
+    Frame[frame].Merged=mapping;
+    *pte=(*pte&~PTBL_PHYS_PG_NO)|PTBL_READ_ONLY_BIT|frame;
+    osFlushTLBEntry(owner, page);
+}
+
+//Fold frame drop, whose contents equal frame keep's, into keep and free it
+void MergeFrames(int keep,int drop){
+    addMergeMapping(keep, Frame[drop].Owner, Frame[drop].LogicalPage, Frame[drop].PTE);
+    while(Frame[drop].Merged!=NULL){
+        MergeMapping *mapping=Frame[drop].Merged;
+        Frame[drop].Merged=mapping->next;
+        addMergeMapping(keep, mapping->Owner, mapping->LogicalPage, mapping->PTE);
+        free(mapping);
+    }
+    *Frame[keep].PTE|=PTBL_READ_ONLY_BIT;
+    osFlushTLBEntry(Frame[keep].Owner, Frame[keep].LogicalPage);
+    Frame[keep].State|=Frame[drop].State&FRAME_REFERENCED;
+    Frame[drop].Owner->ResidentFrames--;
+    resetPhysicalFrame(drop);
+    PagesMerged++;
+    MergedPages++;
+}
+
+//Take one PTE off a merged frame.  If it was the owner's, the next mapping
+//becomes the owner.  A frame left with a single mapping is writable again.
+void UnmergeMapping(int frame,UINT16 *pte){
+    if(Frame[frame].PTE==pte){
+        MergeMapping *heir=Frame[frame].Merged;
+        Frame[frame].Owner->ResidentFrames--;
+        Frame[frame].Owner=heir->Owner;
+        Frame[frame].Pid=heir->Owner->processID;
+        Frame[frame].LogicalPage=heir->LogicalPage;
+        Frame[frame].PTE=heir->PTE;
+        heir->Owner->ResidentFrames++;
+        Frame[frame].Merged=heir->next;
+        free(heir);
+    }
+    else{
+        MergeMapping **link=&Frame[frame].Merged;
+        while(*link!=NULL && (*link)->PTE!=pte){
+            link=&(*link)->next;
+        }
+        if(*link==NULL){
+            return;
+        }
+        MergeMapping *gone=*link;
+        *link=gone->next;
+        free(gone);
+    }
+    MergedPages--;
+    if(Frame[frame].Merged==NULL){
+        *Frame[frame].PTE&=~PTBL_READ_ONLY_BIT;
+    }
+}
+
+//A write to a merged page: copy it into a frame of its own
+void UnmergeOnWrite(PCB *pcb,int pageNo,UINT16 *pte){
+    char data[PGSIZE];
+    int frame=*pte&PTBL_PHYS_PG_NO;
+    if(Frame[frame].Merged==NULL){
+        *pte&=~PTBL_READ_ONLY_BIT;
+        return;
+    }
+    Z502ReadPhysicalMemory(frame, data);
+    UnmergeMapping(frame, pte);
+    *pte=isPageInDisk(pcb->processID, pageNo)?PTBL_SWAPPED_BIT:0;
+    osFlushTLBEntry(pcb, pageNo);
+    int newframe=obtainFrame(pcb);
+    Z502WritePhysicalMemory(newframe, data);
+    assignFrame(newframe, pcb, pageNo, PTBL_VALID_BIT|PTBL_REFERENCED_BIT, FRAME_VALID|FRAME_REFERENCED);
+    Unmerges++;
+}
+
+//The merge scanner: hash every private frame and merge those whose
+//contents match one already seen.  Returns the number of frames freed.
+int MergeScan(){
+    char page[PGSIZE];
+    char other[PGSIZE];
+    int freed=0;
+    int buckets=NUMBER_PHYSICAL_PAGES;
+    int *bucket=(int *)malloc(buckets*sizeof(int));
+    int *chain=(int *)malloc(NUMBER_PHYSICAL_PAGES*sizeof(int));
+    UINT32 *hashes=(UINT32 *)malloc(NUMBER_PHYSICAL_PAGES*sizeof(UINT32));
+    for(int i=0;i<buckets;i++){
+        bucket[i]=-1;
+    }
+    MergeScans++;
+    for(int i=0;i<NUMBER_PHYSICAL_PAGES;i++){
+        if(Frame[i].InUse==FALSE || Frame[i].Shared!=NULL || Frame[i].Prefetched!=0){
+            continue;
+        }
+        Z502ReadPhysicalMemory(i, page);
+        UINT32 hash=HashPage(page);
+        int b=hash%buckets;
+        bool merged=false;
+        for(int j=bucket[b];j!=-1;j=chain[j]){
+            if(hashes[j]!=hash){
+                continue;
+            }
+            Z502ReadPhysicalMemory(j, other);
+            if(memcmp(page, other, PGSIZE)==0){
+                MergeFrames(j, i);
+                freed++;
+                merged=true;
+                break;
+            }
+        }
+        if(merged==false){
+            hashes[i]=hash;
+            chain[i]=bucket[b];
+            bucket[b]=i;
+        }
+    }
+    free(bucket);
+    free(chain);
+    free(hashes);
+    return freed;
+}
+
+//A process going away stops mapping merged frames; frames it owned pass
+//to another of their mappings rather than being freed.
+void MergeDetachProcess(INT32 processID){
+    for(int i=0;i<NUMBER_PHYSICAL_PAGES;i++){
+        MergeMapping *mapping=Frame[i].Merged;
+        while(mapping!=NULL){
+            MergeMapping *next=mapping->next;
+            if(mapping->Owner->processID==processID){
+                UnmergeMapping(i, mapping->PTE);
+            }
+            mapping=next;
+        }
+        if(Frame[i].Merged!=NULL && Frame[i].Pid==processID){
+            UnmergeMapping(i, Frame[i].PTE);
+        }
+    }
+}
+
+SharedArea *FindSharedArea(char *Tag){
+    SharedArea *area=SharedAreas;
+    while(area!=NULL){
+        if(strncmp(area->Tag, Tag, SHARED_AREA_TAG_LENGTH-1)==0){
+            return area;
+        }
+        area=area->next;
+    }
+    return NULL;
+}
+
+//Point the process's page table at the area's frames, starting at StartPage.
+//A private page already there, resident or swapped, is thrown away.
+void MapSharedArea(SharedArea *area,PCB *pcb,int StartPage){
+    for(int i=0;i<area->Pages;i++){
+        UINT16 *pte=GetPTE(pcb, StartPage+i, true);
+        int frame=*pte&PTBL_PHYS_PG_NO;
+        if((*pte&PTBL_VALID_BIT)!=0 && Frame[frame].Merged!=NULL){
+            UnmergeMapping(frame, pte);
+        }
+        else if((*pte&PTBL_VALID_BIT)!=0 && Frame[frame].PTE==pte){
+            releaseFrame(frame);
+        }
+        SwapDiscard(pcb->processID, StartPage+i);
+        *pte=PTBL_VALID_BIT|area->Frames[i];
+    }
+}
+
+//DEFINE_SHARED_AREA: the first process to name a tag creates the area, and
+//every caller, the first included, gets the next shared ID starting from 0.
+void DefineSharedArea(long StartAddress,long Pages,char *Tag,INT32 *SharedID,INT32 *Result){
+    MEMORY_MAPPED_IO mmio;
+    INT32 ProcessID=osGetCurrentProcessID();
+    PCB *pcb=GetProcessByID(ProcessID);
+    long StartPage=StartAddress/PGSIZE;
+    if(StartAddress<0 || StartAddress%PGSIZE!=0 || Pages<=0 || StartPage+Pages>NUMBER_VIRTUAL_PAGES){
+        *Result=ERR_BAD_PARAM;
+        return;
+    }
+    mmio.Field1 = mmio.Field2 = mmio.Field3 = 0;
+    mmio.Mode=Z502GetPageTable;
+    MEM_READ(Z502Context, &mmio);
+    pcb->Pagetable=(UINT16 **)mmio.Field1;
+    SharedArea *area=FindSharedArea(Tag);
+    if(area==NULL){
+        if(SharedFrames+Pages>NUMBER_PHYSICAL_PAGES/2){
+            *Result=ERR_BAD_PARAM;
+            return;
+        }
+        area=(SharedArea *)calloc(1, sizeof(SharedArea));
+        strncpy(area->Tag, Tag, SHARED_AREA_TAG_LENGTH-1);
+        area->Pages=Pages;
+        area->Frames=(INT32 *)calloc(Pages, sizeof(INT32));
+        for(int i=0;i<Pages;i++){
+            int frame=obtainFrame(pcb);
+            ZeroFillFrame(frame);
+            FreeFrameCount--;
+            Frame[frame].InUse=TRUE;
+            Frame[frame].Pid=ProcessID;
+            Frame[frame].LogicalPage=StartPage+i;
+            Frame[frame].State=FRAME_VALID;
+            Frame[frame].Shared=area;
+            area->Frames[i]=frame;
+        }
+        SharedFrames+=Pages;
+        area->next=SharedAreas;
+        SharedAreas=area;
+    }
+    else if(area->Pages!=Pages){
+        *Result=ERR_BAD_PARAM;
+        return;
+    }
+    MapSharedArea(area, pcb, StartPage);
+    SharedAttach *attach=(SharedAttach *)calloc(1, sizeof(SharedAttach));
+    attach->ProcessID=ProcessID;
+    attach->next=area->Attached;
+    area->Attached=attach;
+    area->Users++;
+    *SharedID=area->NextSharedID++;
+    *Result=ERR_SUCCESS;
+}
+
+//A process that goes away stops using its shared areas; when the last
+//user is gone the area's frames are freed.
+void SharedAreaDetach(INT32 processID){
+    SharedArea **link=&SharedAreas;
+    while(*link!=NULL){
+        SharedArea *area=*link;
+        SharedAttach **attach=&area->Attached;
+        while(*attach!=NULL){
+            if((*attach)->ProcessID==processID){
+                SharedAttach *gone=*attach;
+                *attach=gone->next;
+                free(gone);
+                area->Users--;
+            }
+            else{
+                attach=&(*attach)->next;
+            }
+        }
+        if(area->Users==0){
+            for(int i=0;i<area->Pages;i++){
+                resetPhysicalFrame(area->Frames[i]);
+            }
+            SharedFrames-=area->Pages;
+            *link=area->next;
+            free(area->Frames);
+            free(area);
+        }
+        else{
+            link=&area->next;
+        }
+    }
+}
+
+//Write the dirty resident pages of a mapping back to the file.  With
+//release set the pages are unmapped as well.
+void FileMappingWriteBack(FileMapping *mapping,bool release){
+    PCB *pcb=mapping->Owner;
+    KernelMutexAcquire(&PagerMutex);
+    for(int page=mapping->StartPage;page<mapping->StartPage+mapping->Pages;page++){
+        UINT16 *pte=GetPTE(pcb, page, false);
+        if(pte==NULL || (*pte&PTBL_VALID_BIT)==0){
+            continue;
+        }
+        int frame=*pte&PTBL_PHYS_PG_NO;
+        if((*pte&PTBL_MODIFIED_BIT)!=0){
+            TransferMappedPage(mapping, page, frame, Z502DiskWrite);
+            *pte&=~PTBL_MODIFIED_BIT;
+            osFlushTLBEntry(pcb, page);
+            FileWritebacks++;
+        }
+        if(release==false){
+            continue;
+        }
+        if(Frame[frame].Merged!=NULL){
+            UnmergeMapping(frame, pte);
+            *pte=0;
+            osFlushTLBEntry(pcb, page);
+        }
+        else if(Frame[frame].PTE==pte){
+            releaseFrame(frame);
+        }
+    }
+    KernelMutexRelease(&PagerMutex);
+}
+
+void FileMappingRemove(FileMapping *mapping){
+    FileMapping **link=&FileMappings;
+    while(*link!=mapping){
+        link=&(*link)->next;
+    }
+    *link=mapping->next;
+    free(mapping->Sectors);
+    free(mapping);
+}
+
+//A process going away keeps what it wrote to its mapped files
+void FileMappingDetach(INT32 processID){
+    FileMapping *mapping=FileMappings;
+    while(mapping!=NULL){
+        FileMapping *next=mapping->next;
+        if(mapping->Owner->processID==processID){
+            FileMappingWriteBack(mapping, false);
+            FileMappingRemove(mapping);
+        }
+        mapping=next;
+    }
+}
+
+//A process going away gives up its swap copies, cached and on disk
+void SwapDetachProcess(INT32 processID){
+    for(int bucket=0;bucket<SWAP_HASH_BUCKETS;bucket++){
+        SwapEntry **link=&SwapHash[bucket];
+        while(*link!=NULL){
+            SwapEntry *entry=*link;
+            if(entry->ProcessID!=processID){
+                link=&entry->next;
+                continue;
+            }
+            if(entry->Cached!=NULL){
+                SwapCacheRemove(entry);
+            }
+            if(entry->SectorID>=0){
+                ReleaseSwapSlot(entry->DiskID, entry->SectorID);
+            }
+            *link=entry->next;
+            entry->next=SwapEntryFreeList;
+            SwapEntryFreeList=entry;
+        }
+    }
+}
+
+//When a process goes away its frames go back on the free list
+void releaseProcessFrames(INT32 processID){
+    KernelMutexAcquire(&PagerMutex);
+    FileMappingDetach(processID);
+    MergeDetachProcess(processID);
     for(int i=0;i<NUMBER_PHYSICAL_PAGES;i++){
-        if(Frame[i].InUse==FALSE){
-            return i;
+        if(Frame[i].InUse==TRUE && Frame[i].Pid==processID && Frame[i].Shared==NULL){
+            resetPhysicalFrame(i);
         }
     }
-    return -1;
+    SharedAreaDetach(processID);
+    SwapDetachProcess(processID);
+    PCB *pcb=GetProcessByID(processID);
+    if(pcb->processID==processID){
+        FreePageTable(pcb);
+    }
+    KernelMutexRelease(&PagerMutex);
 }
 
-
-//The Page Selection Algorithms is based on second-chance algorithms
-int getVictimFrames(int processID){
-    int victimframes=-1;
-    while(true){
-        for(int i=0;i<NUMBER_PHYSICAL_PAGES;i++){
-            if(Frame[i].Pid==processID){
-                if((Frame[i].State&FRAME_REFERENCED)==0){
-                    victimframes=i;
-                    break;
-                }
-                else{
-                    Frame[i].State=Frame[i].State-1;
-                }
+//Write out every private page of a process.  Dirty pages go straight to
+//the swap disk in sector-ordered batches rather than through the swap
+//cache, which would only push out pages of processes still running.
+//Shared and merged frames stay where they are.
+void SwapOutProcess(PCB *pcb){
+    SwapEntry *batch[SWAP_CACHE_SPILL_BATCH];
+    int frames[SWAP_CACHE_SPILL_BATCH];
+    char diskwrite[SWAP_CACHE_SPILL_BATCH][PGSIZE];
+    int count=0;
+    for(int i=0;i<=NUMBER_PHYSICAL_PAGES;i++){
+        if(count==SWAP_CACHE_SPILL_BATCH || (i==NUMBER_PHYSICAL_PAGES && count>0)){
+            for(int j=0;j<count;j++){
+                Z502ReadPhysicalMemory(frames[j], diskwrite[j]);
+            }
+            SwapTransferBatch(batch, diskwrite, count, Z502DiskWrite);
+            for(int j=0;j<count;j++){
+                batch[j]->CopyValid=TRUE;
+                releaseFrame(frames[j]);
+                DirtyEvictions++;
             }
+            count=0;
         }
-        if(victimframes!=-1){
+        if(i==NUMBER_PHYSICAL_PAGES){
             break;
         }
+        if(Frame[i].InUse==FALSE || Frame[i].Owner!=pcb || Frame[i].Shared!=NULL || Frame[i].Merged!=NULL){
+            continue;
+        }
+        int page=Frame[i].LogicalPage;
+        if(FindFileMapping(pcb, page)!=NULL){
+            writeVictimToDisk(i);
+            releaseFrame(i);
+            LoadControlPageOuts++;
+            continue;
+        }
+        SwapEntry *entry=SwapLookup(pcb->processID, page);
+        if(entry!=NULL && entry->CopyValid==TRUE && (*Frame[i].PTE&PTBL_MODIFIED_BIT)==0){
+            releaseFrame(i);
+            CleanEvictions++;
+            LoadControlPageOuts++;
+            continue;
+        }
+        if(entry==NULL){
+            entry=SwapInsert(pcb->processID, page, -1);
+        }
+        if(entry->Cached!=NULL){
+            SwapCacheRemove(entry);
+        }
+        if(entry->SectorID<0){
+            entry->SectorID=AllocateSwapSlot(&entry->DiskID);
+        }
+        if(entry->SectorID<0){
+            writeVictimToDisk(i);
+            releaseFrame(i);
+            LoadControlPageOuts++;
+            continue;
+        }
+        int slot=count;
+        while(slot>0 && SwapSlotBefore(entry, batch[slot-1])){
+            batch[slot]=batch[slot-1];
+            frames[slot]=frames[slot-1];
+            slot--;
+        }
+        batch[slot]=entry;
+        frames[slot]=i;
+        count++;
+        LoadControlPageOuts++;
     }
-    return victimframes;
 }
 
-int findAvailableSector(short DiskID){
-    int SectorID=0;
-    for(int i=0;i<NUMBER_LOGICAL_SECTORS;i++){
-        if(BitMap[DiskID][i]==0){
-            SectorID=i;
-            break;
+//The least favourable process that may be swapped out; ties go to the
+//one holding the most frames.  Never the running process.
+PCB *selectDeactivation(PCB *current){
+    PCB *victim=NULL;
+    int active=0;
+    int i=0;
+    while(QWalk(PCBQueueID,i)!=(void *)-1){
+        PCB *candidate=QWalk(PCBQueueID, i);
+        i++;
+        if(candidate->LoadState!=LOAD_ACTIVE){
+            continue;
+        }
+        active++;
+//        Nor one that holds or is waiting for a kernel mutex: it would be
+//        handed the mutex while swapped out and keep everyone else waiting
+        if(candidate==current || candidate==PagerMutex.Holder || candidate==FileSystemMutex.Holder
+           || QItemExists(PagerMutex.WaitQueueID, candidate)!=(void *)-1 || QItemExists(FileSystemMutex.WaitQueueID, candidate)!=(void *)-1){
+            continue;
+        }
+        if(victim==NULL || candidate->processPriority>victim->processPriority
+           || (candidate->processPriority==victim->processPriority && candidate->ResidentFrames>victim->ResidentFrames)){
+            victim=candidate;
         }
     }
-    return SectorID;
+    if(active<=LOAD_CONTROL_MIN_ACTIVE){
+        return NULL;
+    }
+    return victim;
 }
 
-bool isPageInDisk(int pageNo){
-    for(int i=0;i<500;i++){
-        if(SwapArea[i].virtualPage==pageNo){
-            return true;
-        }
+void DeactivateProcess(PCB *pcb){
+    pcb->LoadState=LOAD_DEACTIVATED;
+    if(QItemExists(ReadyQueueID, pcb)!=(void *)-1){
+        QRemoveItem(ReadyQueueID, pcb);
+        pcb->LoadState=LOAD_DEACTIVATED_READY;
     }
-    return false;
+    QInsert(InactiveQueueID, pcb->processPriority, pcb);
+    SwapOutProcess(pcb);
+    Deactivations++;
 }
 
+//Pages come back by demand faults; a process that became ready while
+//swapped out goes on the ready queue now.
+void ReactivateProcess(PCB *pcb){
+    INT32 state=pcb->LoadState;
+    QRemoveItem(InactiveQueueID, pcb);
+    pcb->LoadState=LOAD_ACTIVE;
+    pcb->FrameAllocation=0;
+    if(state==LOAD_DEACTIVATED_READY){
+        AddtoReadyQueue(pcb);
+    }
+    Reactivations++;
+}
 
-void ReadVirtualPagetoMemory(int physicalframes,int pageNo,int pid){
-    char diskwrite[16];
-    char diskread[16];
-    for(int i=0;i<16;i++){
-        diskwrite[i]=0;
-        diskread[i]=0;
+//The medium-term scheduler.  Each fault counts toward the current window;
+//when a window closes its fault rate decides whether to swap a process
+//out or let one back in.  When idle, a swapped-out process that is ready
+//to run is let back in at once.  Returns the number of processes let in.
+int LoadControl(int idle){
+    if(idle){
+        int i=0;
+        while(QWalk(InactiveQueueID,i)!=(void *)-1){
+            PCB *pcb=QWalk(InactiveQueueID, i);
+            if(pcb->LoadState==LOAD_DEACTIVATED_READY){
+                ReactivateProcess(pcb);
+                return 1;
+            }
+            i++;
+        }
+        return 0;
     }
-    for(int i=0;i<500;i++){
-        if(SwapArea[i].virtualPage==pageNo){
-            osReadOnDisk(0,SwapArea[i].SectorID, (long)diskread);
-            Z502WritePhysicalMemory(physicalframes, diskread);
-            SwapArea[i].ProcessID=-1;
-            SwapArea[i].InUse=false;
-            SwapArea[i].SectorID=0;
-            SwapArea[i].virtualPage=-1;
-            break;
+    long CurrentTime=Get_CurrentTime();
+    if(CurrentTime-LoadWindowStart<LOAD_CONTROL_WINDOW){
+        return 0;
+    }
+    long rate=LoadFaultsInWindow*LOAD_CONTROL_WINDOW/(CurrentTime-LoadWindowStart);
+    LoadWindowStart=CurrentTime;
+    LoadFaultsInWindow=0;
+    if(rate>LOAD_CONTROL_UPPER_THRESHOLD){
+        PCB *victim=selectDeactivation(GetProcessByID(osGetCurrentProcessID()));
+        if(victim!=NULL){
+            DeactivateProcess(victim);
         }
+        return 0;
+    }
+    if(rate<LOAD_CONTROL_LOWER_THRESHOLD && QNextItemInfo(InactiveQueueID)!=(void *)-1){
+        ReactivateProcess((PCB *)QNextItemInfo(InactiveQueueID));
+        return 1;
     }
+    return 0;
 }
 
 
-void writeVictimToDisk(int victimframes,int victimVitualPageNo,int pid,int Status,short *virtualPageNo){
-    char diskwrite[16];
-    char diskread[16];
-    for(int i=0;i<16;i++){
-        diskwrite[i]=0;
-        diskread[i]=0;
+
+//Bring a page in for pcb.  The pager may block on the disk, so it runs
+//under the pager mutex.
+void PageFault(PCB *pcb,INT32 Status){
+    KernelMutexAcquire(&PagerMutex);
+//    The fault may be for a page whose leaf table doesn't exist yet
+    UINT16 *pte=GetPTE(pcb, Status, true);
+    if(pte==NULL){
+        KernelMutexRelease(&PagerMutex);
+        return;
     }
-    Z502ReadPhysicalMemory(victimframes, diskread);
-    short SectorID;
-    if(isPageInDisk(victimVitualPageNo)){
-        for(int i=0;i<500;i++){
-            if(SwapArea[i].virtualPage==victimVitualPageNo && SwapArea[i].ProcessID==pid){
-                osWriteToDisk(0,SwapArea[i].SectorID, (long)diskread);
-                break;
-            }
-        }
+    if((*pte&PTBL_VALID_BIT)!=0 && (*pte&PTBL_READ_ONLY_BIT)!=0){
+        UnmergeOnWrite(pcb, Status, pte);
+        KernelMutexRelease(&PagerMutex);
+        return;
+    }
+//    The page may have come in while this process waited for the pager
+    if((*pte&PTBL_VALID_BIT)!=0){
+        KernelMutexRelease(&PagerMutex);
+        return;
+    }
+    UpdateFaultFrequency(pcb);
+    LoadFaultsInWindow++;
+    if(FreeFrameCount>0){
+        FaultsWithFreeFrame++;
     }
     else{
-        SectorID=findAvailableSector(0);
-        for(int i=0;i<500;i++){
-            if(SwapArea[i].InUse==false){
-                SwapArea[i].InUse=true;
-                SwapArea[i].ProcessID=pid;
-                SwapArea[i].SectorID=SectorID;
-                SwapArea[i].virtualPage=victimVitualPageNo;
-                osWriteToDisk(0,SectorID, (long)diskread);
-                BitMap[0][SectorID]=1;
-                break;
-            }
+        FaultsWithEviction++;
+    }
+    int physicalframes=obtainFrame(pcb);
+    FileMapping *mapping=FindFileMapping(pcb, Status);
+    if(mapping!=NULL){
+        TransferMappedPage(mapping, Status, physicalframes, Z502DiskRead);
+        MappedFileFaults++;
+    }
+    else if((*pte&PTBL_SWAPPED_BIT)!=0){
+        ReadVirtualPagetoMemory(physicalframes,Status,pcb->processID);
+        SwapInFaults++;
+    }
+    else{
+        ZeroFillFrame(physicalframes);
+        ZeroFillFaults++;
+    }
+    assignFrame(physicalframes, pcb, Status, PTBL_VALID_BIT|PTBL_REFERENCED_BIT, FRAME_VALID|FRAME_REFERENCED);
+    FaultAround(pcb, Status);
+    if(PAGE_MERGING && ++FaultsSinceMergeScan>=MERGE_SCAN_INTERVAL){
+        FaultsSinceMergeScan=0;
+        MergeScan();
+    }
+    LoadControl(false);
+    KernelMutexRelease(&PagerMutex);
+//    Deferred until the fault is serviced and the pager has been let go,
+//    so a process waiting on the pager gets its fault handled first
+    if(FreeFrameCount<PAGEOUT_LOW_WATERMARK){
+        KernelMutexAcquire(&PagerMutex);
+        if(FreeFrameCount<PAGEOUT_LOW_WATERMARK){
+            PageOutDaemon(false);
         }
+        KernelMutexRelease(&PagerMutex);
     }
 }
 
-void resetPhysicalFrame(int physicalframes){
-    Frame[physicalframes].InUse=false;
-    Frame[physicalframes].Pid=-1;
-    Frame[physicalframes].State=-1;
-    Frame[physicalframes].LogicalPage=-1;
-}
-
-
-
 void FaultHandler(void) {
     INT32 DeviceID;
     INT32 Status;
@@ -769,31 +2887,9 @@ void FaultHandler(void) {
             mmio.Field1 = mmio.Field2 = mmio.Field3 = 0;
             mmio.Mode=Z502GetPageTable;
             MEM_READ(Z502Context, &mmio);
-            short *virtualPageNo;
-            virtualPageNo=(short *)mmio.Field1;
-            int physicalframes=getPhysicalFrame();
-            if(physicalframes==-1){
-                int pid=osGetCurrentProcessID();
-                int victimframes=getVictimFrames(pid);
-                int victimVitualPageNo=Frame[victimframes].LogicalPage;
-                writeVictimToDisk(victimframes, victimVitualPageNo, pid,Status,virtualPageNo);
-                if(isPageInDisk(Status)){
-                    ReadVirtualPagetoMemory(victimframes,Status,pid);
-                }
-                virtualPageNo[Status]=PTBL_VALID_BIT|PTBL_REFERENCED_BIT|victimframes;
-                virtualPageNo[victimframes]=0;
-                Frame[victimframes].InUse=TRUE;
-                Frame[victimframes].Pid=osGetCurrentProcessID();
-                Frame[victimframes].LogicalPage=Status;
-                Frame[victimframes].State=FRAME_VALID|FRAME_REFERENCED;
-            }
-            else{
-                virtualPageNo[Status]=PTBL_VALID_BIT|PTBL_REFERENCED_BIT|physicalframes;
-                Frame[physicalframes].InUse=TRUE;
-                Frame[physicalframes].Pid=osGetCurrentProcessID();
-                Frame[physicalframes].LogicalPage=Status;
-                Frame[physicalframes].State=FRAME_VALID|FRAME_REFERENCED;
-            }
+            PCB *pcb=GetProcessByID(osGetCurrentProcessID());
+            pcb->Pagetable=(UINT16 **)mmio.Field1;
+            PageFault(pcb, Status);
             break;
         case INVALID_PHYSICAL_MEMORY:
             break;
@@ -815,6 +2911,61 @@ void FaultHandler(void) {
 }
 
 
+void PrintPagingStatistics(void){
+    if(DiskRequests>0){
+        aprintf("Disk: Requests = %ld: Queued Behind Another = %ld: Blocked Waits = %ld\n", DiskRequests, DiskRequestsQueued, DiskBlockedWaits);
+        for(int d=0;d<MAX_NUMBER_OF_DISKS;d++){
+            if(DiskIssued[d]>0){
+                aprintf("Disk %d: Requests = %ld: Merged = %ld: Mean Queue Depth = %.2f: Mean Seek = %.1f: Mean Service Time = %.1f\n", d, DiskArrivals[d], DiskMerges[d], (double)DiskQueueDepthSum[d]/(DiskArrivals[d]-DiskMerges[d]), (double)DiskSeekDistance[d]/DiskIssued[d], (double)DiskServiceTime[d]/DiskIssued[d]);
+            }
+        }
+    }
+    if(BufferCacheHits+BufferCacheMisses>0){
+        aprintf("Buffer Cache: Hits = %ld: Misses = %ld: Hit Ratio = %.3f: Evictions = %ld: Write Backs = %ld: Idle Flushes = %ld\n", BufferCacheHits, BufferCacheMisses, (double)BufferCacheHits/(BufferCacheHits+BufferCacheMisses), BufferCacheEvictions, BufferCacheWriteBacks, BufferCacheIdleFlushes);
+    }
+    if(DentryHits+DentryMisses>0){
+        aprintf("Dentry Cache: Hits = %ld: Misses = %ld: Hit Ratio = %.3f\n", DentryHits, DentryMisses, (double)DentryHits/(DentryHits+DentryMisses));
+    }
+    if(IndexTranslations>0){
+        aprintf("Index Cache: Translations = %ld: Memo Hits = %ld: Node Reads = %ld\n", IndexTranslations, IndexMemoHits, IndexNodeReads);
+    }
+    if(CleanEvictions+DirtyEvictions==0){
+        return;
+    }
+    aprintf("Paging: Clean Evictions = %ld: Dirty Evictions = %ld\n", CleanEvictions, DirtyEvictions);
+    if(SwapTransfers>0){
+        aprintf("Paging: Swap Disks = %d: Swap Transfers = %ld: Transfer Batches = %ld\n", SWAP_DISK_COUNT, SwapTransfers, SwapTransferBatches);
+    }
+    if(SwapCacheBytesStored>0){
+        aprintf("Paging: Swap Cache Hits = %ld: Misses = %ld: Hit Ratio = %.3f: Compression Ratio = %.2f: Spilled Pages = %ld\n",
+                SwapCacheHits, SwapCacheMisses,
+                (SwapCacheHits+SwapCacheMisses)==0?0.0:(double)SwapCacheHits/(double)(SwapCacheHits+SwapCacheMisses),
+                (double)SwapCacheBytesIn/(double)SwapCacheBytesStored, SwapCacheSpills);
+    }
+    aprintf("Paging: Zero Fill Faults = %ld: Swap In Faults = %ld\n", ZeroFillFaults, SwapInFaults);
+    aprintf("Paging: Faults With Free Frame = %ld: Faults With Eviction = %ld: Daemon Evictions = %ld\n", FaultsWithFreeFrame, FaultsWithEviction, DaemonEvictions);
+    int i=0;
+    while((int)QWalk(PCBQueueID,i)!=-1){
+        PCB *pcb=QWalk(PCBQueueID, i);
+        if(pcb->PageFaults>0){
+            aprintf("Paging: PID %d: Resident Frames = %d: Frame Allocation = %d: Page Faults = %ld: Page Table Leaves = %d\n", pcb->processID, pcb->ResidentFrames, pcb->FrameAllocation, pcb->PageFaults, pcb->PageTableLeaves);
+        }
+        i++;
+    }
+    if(MappedFileFaults>0){
+        aprintf("Paging: Mapped File Faults = %ld: File Writebacks = %ld\n", MappedFileFaults, FileWritebacks);
+    }
+    if(Deactivations>0){
+        aprintf("Paging: Load Control Deactivations = %ld: Reactivations = %ld: Pages Written Out = %ld\n", Deactivations, Reactivations, LoadControlPageOuts);
+    }
+    if(MergeScans>0){
+        aprintf("Paging: Merge Scans = %ld: Pages Merged = %ld: Frames Saved = %ld: Unmerges = %ld\n", MergeScans, PagesMerged, MergedPages, Unmerges);
+    }
+    if(PrefetchedPages>0){
+        aprintf("Paging: Prefetched Pages = %ld: Prefetch Hits = %ld: Wasted Prefetches = %ld\n", PrefetchedPages, PrefetchHits, WastedPrefetches);
+    }
+}
+
 PCB *Get_the_last_PCB(void){
     PCB *pcb=QWalk(PCBQueueID, 0);
     int i=0;
@@ -839,10 +2990,11 @@ long osCreateProcess(INT32 processID,char processName[30],INT32 processPriority,
         }
         i++;
     }
-    newPCB=pcbEnd=(PCB*) malloc(sizeof(PCB));
+    newPCB=pcbEnd=(PCB*) calloc(1, sizeof(PCB));
     newPCB->processID=processID;
     strcpy(newPCB->processName,processName);
     newPCB->processPriority=processPriority;
+    newPCB->Pagetable=(UINT16 **)PageTable;
     long ContextID=osInitailizeContext(Address, PageTable);
     newPCB->currentContext=ContextID;
     QInsertOnTail(PCBQueueID, newPCB);
@@ -858,6 +3010,13 @@ void RemoveFromPCB(INT32 processID, long *ReturnStatus){
     while((int)QWalk(PCBQueueID,i)!=-1){
         PCB *pcb=QWalk(PCBQueueID, i);
         if(pcb->processID==processID){
+            if(QItemExists(InactiveQueueID, pcb)!=(void *)-1){
+                QRemoveItem(InactiveQueueID, pcb);
+            }
+            KernelMutexDetach(&FileSystemMutex, pcb);
+            KernelMutexDetach(&PagerMutex, pcb);
+            DiskRequestsDetach(pcb);
+            releaseProcessFrames(processID);
             QRemoveItem(PCBQueueID, pcb);
             *ReturnStatus=ERR_SUCCESS;
         }
@@ -926,9 +3085,6 @@ void osSuspendProcess(INT32 PID,long *Result){
                 QInsertOnTail(TimerSuspendQ, pcbid);
                 QRemoveItem(TimerQueueID, pcb);
             }
-            if((int)QItemExists(DiskQueueID, pcb)!=-1){
-                QRemoveItem(DiskQueueID, pcb);
-            }
             *Result=ERR_SUCCESS;
         }
     }
@@ -970,6 +3126,8 @@ void TerminateProcess(INT32 ProcessID,long *Result){
         INT32 PID=osGetCurrentProcessID();
         PCB *pcb=QWalk(PCBQueueID, 0);
         if(pcb->processID==PID){
+            BufferCacheSync(-1, Result);
+            PrintPagingStatistics();
             HaltZ502();
         }
         else{
@@ -1000,15 +3158,6 @@ void TerminateProcess(INT32 ProcessID,long *Result){
                 }
                 i++;
             }
-            i=0;
-            while((int)QWalk(DiskQueueID,i)!=-1){
-                PCB *pcb=QWalk(DiskQueueID, i);
-                if(pcb->processID==PID){
-                    RemoveDiskQueueProcess(pcb);
-                    break;
-                }
-                i++;
-            }
             osDispatcher();
         }
         QInsertOnTail(TerminatedQueueID, &PID);
@@ -1016,6 +3165,8 @@ void TerminateProcess(INT32 ProcessID,long *Result){
     if(ProcessID==-2){
         INT32 PID=osGetCurrentProcessID();
         QInsertOnTail(TerminatedQueueID, &PID);
+        BufferCacheSync(-1, Result);
+        PrintPagingStatistics();
         HaltZ502();
     }
     else{
@@ -1024,10 +3175,6 @@ void TerminateProcess(INT32 ProcessID,long *Result){
     }
 }
 
-void ModifyBitMap(long DiskID,long SectorID){
-    BitMap[DiskID][SectorID]=1;
-}
-
 long GetCurrentDiskID(){
     INT32 ProcessID=osGetCurrentProcessID();
     PCB *pcb=GetProcessByID(ProcessID);
@@ -1050,7 +3197,7 @@ Header *findFileDirByName(unsigned char Name[7],unsigned int flag){
 
 
 void WriteHeadertoDisk(short DiskID,short SectorID,Header *fileDirhead){
-    unsigned char diskwrite[16];
+    unsigned char diskwrite[PGSIZE];
     diskwrite[0]=fileDirhead->Inode;
     diskwrite[1]=fileDirhead->Name[0];
     diskwrite[2]=fileDirhead->Name[1];
@@ -1069,10 +3216,10 @@ void WriteHeadertoDisk(short DiskID,short SectorID,Header *fileDirhead){
     for(int i=0;i<2;i++){
         diskwrite[14+i]=((fileDirhead->File_Size>>(8*i))&255);
     }
-    osWriteToDisk(DiskID, SectorID, diskwrite);
+    BufferCacheWrite(DiskID, SectorID, diskwrite);
 }
 
-Header *convertReaddatatoHeader(unsigned char diskread[16]){
+Header *convertReaddatatoHeader(unsigned char diskread[PGSIZE]){
     Header *head=(Header*)malloc(sizeof(Header));
     head->Inode=diskread[0];
     unsigned char name[7];
@@ -1095,9 +3242,10 @@ Header *convertReaddatatoHeader(unsigned char diskread[16]){
 
 short CreateNewDataBlock(short DiskID){
     short SectorID=findAvailableSector(DiskID);
-    char DataBlock[16];
-    osWriteToDisk(DiskID,SectorID,DataBlock);
+    char DataBlock[PGSIZE];
+//    Claim the sector before the write, which may let the pager run
     ModifyBitMap(DiskID, SectorID);
+    BufferCacheWrite(DiskID,SectorID,DataBlock);
     return SectorID;
 }
 
@@ -1105,9 +3253,10 @@ short CreateNewDataBlock(short DiskID){
 
 short CreateNewIndexBlock(short DiskID){
     short SectorID=findAvailableSector(DiskID);
-    short IndexBlock[8]={0};
-    osWriteToDisk(DiskID,SectorID,IndexBlock);
+    short IndexBlock[PGSIZE/2]={0};
+//    Claimed first, as above
     ModifyBitMap(DiskID, SectorID);
+    BufferCacheWrite(DiskID,SectorID,IndexBlock);
     return SectorID;
 }
 
@@ -1115,33 +3264,143 @@ short CreateNewIndexBlock(short DiskID){
 int GetMaxIndex(int indexlevel){
     int maxindex=1;
     while(indexlevel>0){
-        maxindex=maxindex*8;
+        maxindex=maxindex*INDEX_BLOCK_FANOUT;
         indexlevel--;
     }
     return maxindex;
 }
 
-// ReadFile and other methods's traversal
+//The file's slot in the index cache, taking the least recently used one
+//if it has none
+IndexCacheEntry *IndexCacheFind(INT16 DiskID,INT16 RootSector,int indexlevel){
+    IndexCacheEntry *cached=NULL;
+    for(int i=0;i<INDEX_CACHE_FILES;i++){
+        if(IndexCache[i].RootSector==RootSector && IndexCache[i].DiskID==DiskID){
+            cached=&IndexCache[i];
+            break;
+        }
+        if(cached==NULL || IndexCache[i].LastUsed<cached->LastUsed){
+            cached=&IndexCache[i];
+        }
+    }
+    if(cached->RootSector!=RootSector || cached->DiskID!=DiskID || cached->Level!=indexlevel){
+        cached->DiskID=DiskID;
+        cached->RootSector=RootSector;
+        cached->Level=indexlevel;
+        for(int level=0;level<INDEX_CACHE_LEVELS;level++){
+            cached->NodeSector[level]=-1;
+        }
+        cached->LastIndex=-1;
+    }
+    cached->LastUsed=++IndexCacheClock;
+    return cached;
+}
+
+// ReadFile and other methods's traversal.  Only index nodes off the path
+// of the file's last walk are read; asking for the same block again reads
+// nothing at all.
 short fetchIndexContent(Header *file,int index){
     unsigned char Description=file->File_Description;
     int indexlevel=(Description&6)>>1;
     int maxindex=GetMaxIndex(indexlevel);
     short DiskID=GetCurrentDiskID();
     short SectorID=file->Index_Location;
-    DISK_DATA *IndexBlock=(DISK_DATA *) calloc(1, sizeof(DISK_DATA));
-    osReadOnDisk(DiskID,SectorID, IndexBlock);
-    maxindex=maxindex/8;
-    while(maxindex>0){
-        short IndexBlock[8]={0};
-        osReadOnDisk(DiskID,SectorID,IndexBlock);
-        int varySectorID=IndexBlock[(int)index/maxindex];
-        SectorID=varySectorID;
+    if(indexlevel==0){
+        return SectorID;
+    }
+    IndexTranslations++;
+    IndexCacheEntry *cached=IndexCacheFind(DiskID, SectorID, indexlevel);
+    if(cached->LastIndex==index){
+        IndexMemoHits++;
+        return cached->LastSector;
+    }
+    int block=index;
+    maxindex=maxindex/INDEX_BLOCK_FANOUT;
+    for(int level=0;maxindex>0;level++){
+        if(cached->NodeSector[level]!=SectorID){
+            short IndexBlock[PGSIZE/2]={0};
+            BufferCacheRead(DiskID,SectorID,IndexBlock);
+            memcpy(cached->Node[level], IndexBlock, PGSIZE);
+            cached->NodeSector[level]=SectorID;
+            IndexNodeReads++;
+        }
+        SectorID=cached->Node[level][(int)index/maxindex];
         index=index%maxindex;
-        maxindex=maxindex/8;
+        maxindex=maxindex/INDEX_BLOCK_FANOUT;
+    }
+//    A hole may be filled in later, so only real blocks are remembered
+    if(SectorID!=0){
+        cached->LastIndex=block;
+        cached->LastSector=SectorID;
     }
     return SectorID;
 }
 
+//Names compare up to their terminator, at most DENTRY_NAME_LENGTH bytes
+int DentryHashIndex(INT16 DiskID,INT16 ParentSector,char *Name,int flag){
+    UINT32 hash=((UINT32)DiskID*NUMBER_LOGICAL_SECTORS+(UINT32)ParentSector)*2+flag;
+    for(int i=0;i<DENTRY_NAME_LENGTH && Name[i]!=0;i++){
+        hash=hash*31+(unsigned char)Name[i];
+    }
+    return (int)(hash&(DENTRY_HASH_BUCKETS-1));
+}
+
+DentryEntry *DentryLookup(INT16 DiskID,INT16 ParentSector,char *Name,int flag){
+    DentryEntry *dentry=DentryHash[DentryHashIndex(DiskID, ParentSector, Name, flag)];
+    while(dentry!=NULL){
+        if(dentry->DiskID==DiskID && dentry->ParentSector==ParentSector && dentry->Flag==flag
+           && strncmp(dentry->Name, Name, DENTRY_NAME_LENGTH)==0){
+            return dentry;
+        }
+        dentry=dentry->next;
+    }
+    return NULL;
+}
+
+void DentryRemove(DentryEntry *dentry){
+    DentryEntry **link=&DentryHash[DentryHashIndex(dentry->DiskID, dentry->ParentSector, dentry->Name, dentry->Flag)];
+    while(*link!=dentry){
+        link=&(*link)->next;
+    }
+    *link=dentry->next;
+    dentry->next=NULL;
+    dentry->InUse=FALSE;
+}
+
+void DentryInsert(INT16 DiskID,INT16 ParentSector,char *Name,int flag,INT16 SectorID){
+    DentryEntry *dentry=DentryLookup(DiskID, ParentSector, Name, flag);
+    if(dentry!=NULL){
+        dentry->SectorID=SectorID;
+        return;
+    }
+    dentry=&DentryEntries[DentryNextSlot];
+    DentryNextSlot=(DentryNextSlot+1)%DENTRY_CACHE_ENTRIES;
+    if(dentry->InUse==TRUE){
+        DentryRemove(dentry);
+    }
+    dentry->DiskID=DiskID;
+    dentry->ParentSector=ParentSector;
+    dentry->Flag=flag;
+    dentry->SectorID=SectorID;
+    strncpy(dentry->Name, Name, DENTRY_NAME_LENGTH);
+    dentry->Name[DENTRY_NAME_LENGTH]=0;
+    dentry->InUse=TRUE;
+    int bucket=DentryHashIndex(DiskID, ParentSector, dentry->Name, flag);
+    dentry->next=DentryHash[bucket];
+    DentryHash[bucket]=dentry;
+}
+
+//Formatting empties every directory on the disk
+void DentryInvalidate(INT16 DiskID){
+    for(int i=0;i<DENTRY_CACHE_ENTRIES;i++){
+        if(DentryEntries[i].InUse==TRUE && DentryEntries[i].DiskID==DiskID){
+            DentryRemove(&DentryEntries[i]);
+        }
+    }
+}
+
+//Look the name up in the current directory.  Only a dentry cache miss
+//walks the directory, and it caches every entry it reads on the way.
 int isDirorFileExist(char Name[7],int flag){
     INT32 ProcessID=osGetCurrentProcessID();
     PCB *pcb=GetProcessByID(ProcessID);
@@ -1151,16 +3410,32 @@ int isDirorFileExist(char Name[7],int flag){
     int size=pcb->OpenDirectory->File_Size;
     int indexlevel=(Description&6)>>1;
     int maxindex=GetMaxIndex(indexlevel);
+    if(Name[0]==0){
+        return -1;
+    }
+    DentryEntry *dentry=DentryLookup(DiskID, pcb->SectorID, Name, flag);
+    if(dentry!=NULL){
+        DentryHits++;
+        return dentry->SectorID;
+    }
+    DentryMisses++;
     for(int i=0;i<size;i++){
 //        DISK_DATA *read=(DISK_DATA *) calloc(1, sizeof(DISK_DATA));
-        unsigned char read[16];
+        unsigned char read[PGSIZE];
         short SectorID=fetchIndexContent(curDir, i);
-        osReadOnDisk(DiskID, SectorID, read);
+        BufferCacheRead(DiskID, SectorID, read);
         int realflag=read[8]&1;
-        if(Name[0]!=0 && Name[0]==read[1] && Name[1]==read[2] && Name[2]==read[3] && Name[3]==read[4] && Name[4]==read[5] && Name[5]==read[6] && Name[6]==read[7] && realflag==flag){
+        char EntryName[DENTRY_NAME_LENGTH+1]={0};
+        memcpy(EntryName, read+1, DENTRY_NAME_LENGTH);
+        if(EntryName[0]==0){
+            continue;
+        }
+        DentryInsert(DiskID, pcb->SectorID, EntryName, realflag, SectorID);
+        if(strncmp(EntryName, Name, DENTRY_NAME_LENGTH)==0 && realflag==flag){
             return SectorID;
         }
     }
+    DentryInsert(DiskID, pcb->SectorID, Name, flag, -1);
     return -1;
 }
 
@@ -1170,11 +3445,11 @@ void expandIndexBlock(Header *head){
     short DiskID=GetCurrentDiskID();
     short newSectorID=findAvailableSector(DiskID);
     ModifyBitMap(DiskID, newSectorID);
-    short IndexBlock[8]={0};
+    short IndexBlock[PGSIZE/2]={0};
     IndexBlock[0]=oldSectorID;
-    osWriteToDisk(DiskID,newSectorID,IndexBlock);
-    short Block[8]={0};
-    osReadOnDisk(DiskID, newSectorID, Block);
+    BufferCacheWrite(DiskID,newSectorID,IndexBlock);
+    short Block[PGSIZE/2]={0};
+    BufferCacheRead(DiskID, newSectorID, Block);
 //    ModifyBitMap(DiskID, newSectorID);
     head->Index_Location=newSectorID;
 }
@@ -1184,11 +3459,12 @@ Header *CreatefileorDirectory(char Name[7], long *Result,int flag){
     INT32 ProcessID=osGetCurrentProcessID();
     PCB *pcb=GetProcessByID(ProcessID);
     short DiskID=GetCurrentDiskID();
-    if(isDirorFileExist(Name,flag)!=-1){
+    short ExistingSectorID=isDirorFileExist(Name,flag);
+    if(ExistingSectorID!=-1){
         *Result=ERR_BAD_PARAM;
-        short SectorID=isDirorFileExist(Name, flag);
-        short headinfo[8];
-        osReadOnDisk(DiskID, SectorID, headinfo);
+        short SectorID=ExistingSectorID;
+        short headinfo[PGSIZE/2];
+        BufferCacheRead(DiskID, SectorID, headinfo);
         Header *head=convertReaddatatoHeader(headinfo);
         return head;
     }
@@ -1214,6 +3490,7 @@ Header *CreatefileorDirectory(char Name[7], long *Result,int flag){
         short HeaderSectorID=curDir->Index_Location;
         ModifyBitMap(DiskID, HeaderSectorID);
         WriteHeadertoDisk(DiskID, HeaderSectorID,head);
+        DentryInsert(DiskID, pcb->SectorID, Name, flag, HeaderSectorID);
         Inodeinfo *inodeinfo=convertHeadertoInodeinfo(head);
         inodeinfo->DiskID=DiskID;
         inodeinfo->SectorID=HeaderSectorID;
@@ -1231,26 +3508,27 @@ Header *CreatefileorDirectory(char Name[7], long *Result,int flag){
         }
         curDir->File_Description=dirparentinode+(Dirindexlevel<<1)+1;
         short varySectorID=curDir->Index_Location;
-        short IndexBlock[8]={0};
-        osReadOnDisk(DiskID,varySectorID,IndexBlock);
+        short IndexBlock[PGSIZE/2]={0};
+        BufferCacheRead(DiskID,varySectorID,IndexBlock);
         short Index=curDir->File_Size;
-        maxindex=maxindex/8;
+        maxindex=maxindex/INDEX_BLOCK_FANOUT;
         while(maxindex>0){
-            short IndexBlock[8]={0};
-            osReadOnDisk(DiskID,varySectorID,IndexBlock);
+            short IndexBlock[PGSIZE/2]={0};
+            BufferCacheRead(DiskID,varySectorID,IndexBlock);
             int SectorID=IndexBlock[Index/maxindex-1];
             if(SectorID==0){
                 SectorID=CreateNewIndexBlock(DiskID);
                 IndexBlock[Index/maxindex-1]=SectorID;
             }
-            osWriteToDisk(DiskID, varySectorID, IndexBlock);
+            BufferCacheWrite(DiskID, varySectorID, IndexBlock);
             varySectorID=SectorID;
             Index=Index%maxindex;
-            maxindex=maxindex/8;
+            maxindex=maxindex/INDEX_BLOCK_FANOUT;
             Dirindexlevel--;
         }
         WriteHeadertoDisk(DiskID, varySectorID, head);
         ModifyBitMap(DiskID, varySectorID);
+        DentryInsert(DiskID, pcb->SectorID, Name, flag, varySectorID);
         Inodeinfo *inodeinfo=convertHeadertoInodeinfo(head);
         inodeinfo->DiskID=DiskID;
         inodeinfo->SectorID=varySectorID;
@@ -1266,10 +3544,13 @@ void OpenDirectory(long DiskID,unsigned char Name[7],long *Result){
     INT32 PID=osGetCurrentProcessID();
     PCB *pcb=GetProcessByID(PID);
     if(strcmp(Name, "root")==0){
+        if(DiskID>=0 && DiskID<MAX_NUMBER_OF_DISKS && BitMapOnDisk[DiskID]==false){
+            BitMapLoad(DiskID);
+        }
         pcb->DiskID=DiskID;
         pcb->SectorID=1;
-        unsigned char diskread[16];
-        osReadOnDisk(DiskID, 1, diskread);
+        unsigned char diskread[PGSIZE];
+        BufferCacheRead(DiskID, 1, (char *)diskread);
         Header *root=convertReaddatatoHeader(diskread);
         pcb->OpenDirectory=root;
         pcb->SectorID=1;
@@ -1283,14 +3564,16 @@ void OpenDirectory(long DiskID,unsigned char Name[7],long *Result){
     Header *curDir;
     if(SectorID==-1){
         curDir=CreatefileorDirectory(Name, Result,1);
+//        Found in the parent, before it stops being the open directory
+        SectorID=isDirorFileExist(Name, 1);
     }
     else{
-        char *diskread[16];
-        osReadOnDisk(DiskID, SectorID, (long)diskread);
+        unsigned char diskread[PGSIZE];
+        BufferCacheRead(DiskID, SectorID, (char *)diskread);
         curDir=convertReaddatatoHeader(diskread);
     }
     pcb->OpenDirectory=curDir;
-    pcb->SectorID=isDirorFileExist(Name, 1);
+    pcb->SectorID=SectorID;
     *Result=ERR_SUCCESS;
 }
 
@@ -1301,14 +3584,14 @@ void OpenFile(char Name[7],long *Inode,long *Result){
     PCB *pcb=GetProcessByID(PID);
     Header *curOpenDir=pcb->OpenDirectory;
     short DiskID=pcb->DiskID;
-    if(isDirorFileExist(Name,0)==-1){
+    short SectorID=isDirorFileExist(Name,0);
+    if(SectorID==-1){
         Header *file=CreatefileorDirectory(Name, Result,0);
         *Inode=file->Inode;
     }
     else{
-        short SectorID=isDirorFileExist(Name, 0);
-        short fileheadinfo[16];
-        osReadOnDisk(DiskID, SectorID, fileheadinfo);
+        short fileheadinfo[PGSIZE/2];
+        BufferCacheRead(DiskID, SectorID, fileheadinfo);
         Header *file=convertReaddatatoHeader(fileheadinfo);
         *Inode=file->Inode;
 //    store fileheader to fileinode vector
@@ -1342,19 +3625,31 @@ void writeRootDir(short DiskID,short SectorID){
 
 void DiskFormat(long DiskID,long *Result){
 //    if there is illegal DiskID
-    if(DiskID<0 || DiskID>8){
+    if(DiskID<0 || DiskID>=MAX_NUMBER_OF_DISKS){
         *Result=ERR_BAD_PARAM;
+        return;
     }
 //    SetUp prameters for sector0 when Formating and Create Root Directory
     INT32 ProcessID=osGetCurrentProcessID();
     PCB *pcb=GetProcessByID(ProcessID);
     pcb->DiskID=DiskID;
     pcb->SectorID=0;
+    BufferCacheInvalidate(DiskID);
+    DentryInvalidate(DiskID);
+    IndexCacheInvalidate(DiskID);
     ModifyBitMap(DiskID, 0);
     Sector0 *sector0=(Sector0*)malloc(sizeof(Sector0));
     sector0->DiskID=(unsigned char)DiskID;
     sector0->RootDir_Location=1;
     ModifyBitMap(DiskID, 1);
+//    The bitmap lives just after the root directory, and is saved from now on
+    sector0->Bitmap_Location=BITMAP_LOCATION;
+    sector0->Bitmap_Size=BITMAP_SIZE_FIELD;
+    for(int sector=0;sector<BITMAP_SECTORS;sector++){
+        ModifyBitMap(DiskID, BITMAP_LOCATION+sector);
+    }
+    BitMapDirtySectors[DiskID]=(1u<<BITMAP_SECTORS)-1;
+    BitMapOnDisk[DiskID]=true;
     writeRootDir(DiskID, 1);
 //    Write Sector to Disk When considering the LBT and MBT.
     DISK_DATA *Block0ToDisk=(DISK_DATA *) calloc(1, sizeof(DISK_DATA));
@@ -1364,13 +3659,13 @@ void DiskFormat(long DiskID,long *Result){
     Block0ToDisk->char_data[3]=sector0->Swap_Size;
     Block0ToDisk->char_data[4]=sector0->Disk_Length&0xFF;
     Block0ToDisk->char_data[5]=(sector0->Disk_Length>>8)&0xFF;
-    Block0ToDisk->char_data[6]=0;
-    Block0ToDisk->char_data[7]=0;
+    Block0ToDisk->char_data[6]=sector0->Bitmap_Location&0xFF;
+    Block0ToDisk->char_data[7]=(sector0->Bitmap_Location>>8)&0xFF;
     Block0ToDisk->char_data[8]=sector0->RootDir_Location&0xFF;
     Block0ToDisk->char_data[9]=(sector0->RootDir_Location>>8)&0xFF;
     Block0ToDisk->char_data[10]=sector0->Swap_Location&0xFF;
     Block0ToDisk->char_data[11]=(sector0->Swap_Location>>8)&0xFF;
-    osWriteToDisk(DiskID, 0, (long)Block0ToDisk->char_data);
+    BufferCacheWrite(DiskID, 0, (char *)Block0ToDisk->char_data);
     *Result=ERR_SUCCESS;
 }
 
@@ -1388,7 +3683,7 @@ void ReadFile(long Inode,long Index,char ReadBuffer[PGSIZE],long *Result){
     short SectorID=fetchIndexContent(filehead, Index);
 //    char IndexBlock[16]={0};
     short DiskID=GetCurrentDiskID();
-    osReadOnDisk(DiskID,SectorID,ReadBuffer);
+    BufferCacheRead(DiskID,SectorID,ReadBuffer);
 }
 
 void WriteFile(long Inode,long Index,char WriteBuffer[PGSIZE],long *Result){
@@ -1405,7 +3700,7 @@ void WriteFile(long Inode,long Index,char WriteBuffer[PGSIZE],long *Result){
     int maxindex=GetMaxIndex(indexlevel);
     if(Index==0){
         short varySectorID=file->Index_Location;
-        osWriteToDisk(DiskID, varySectorID, WriteBuffer);
+        BufferCacheWrite(DiskID, varySectorID, WriteBuffer);
         return;
     }
     while(Index>=maxindex){
@@ -1419,24 +3714,24 @@ void WriteFile(long Inode,long Index,char WriteBuffer[PGSIZE],long *Result){
     inodeinfo->File_Description=parentinode+(indexlevel<<1)+flag;
     inodeinfo->File_Size++;
     short varySectorID=file->Index_Location;
-    short IndexBlock[8]={0};
-    osReadOnDisk(DiskID,varySectorID,IndexBlock);
-    maxindex=maxindex/8;
+    short IndexBlock[PGSIZE/2]={0};
+    BufferCacheRead(DiskID,varySectorID,IndexBlock);
+    maxindex=maxindex/INDEX_BLOCK_FANOUT;
     while(maxindex>0){
-        short IndexBlock[8]={0};
-        osReadOnDisk(DiskID,varySectorID,IndexBlock);
+        short IndexBlock[PGSIZE/2]={0};
+        BufferCacheRead(DiskID,varySectorID,IndexBlock);
         int SectorID=IndexBlock[(int)Index/maxindex];
         if(SectorID==0){
             SectorID=CreateNewIndexBlock(DiskID);
             IndexBlock[(int)Index/maxindex]=SectorID;
         }
-        osWriteToDisk(DiskID, varySectorID, IndexBlock);
+        BufferCacheWrite(DiskID, varySectorID, IndexBlock);
         varySectorID=SectorID;
         Index=Index%maxindex;
-        maxindex=maxindex/8;
+        maxindex=maxindex/INDEX_BLOCK_FANOUT;
         indexlevel--;
     }
-    osWriteToDisk(DiskID, varySectorID, WriteBuffer);
+    BufferCacheWrite(DiskID, varySectorID, WriteBuffer);
     ModifyBitMap(DiskID, varySectorID);
     WriteHeadertoDisk(DiskID, inodeinfo->SectorID, file);
 }
@@ -1452,9 +3747,119 @@ void CloseFile(long Inode,long *Result){
     short SectorID=inodeinfo->SectorID;
     WriteHeadertoDisk(DiskID,SectorID, filehead);
     pcb->FileInode[Inode]=NULL;
+//    Mappings of the file stay usable, but what was written so far is saved now
+    for(FileMapping *mapping=FileMappings;mapping!=NULL;mapping=mapping->next){
+        if(mapping->Owner==pcb && mapping->Inode==Inode){
+            FileMappingWriteBack(mapping, false);
+        }
+    }
+    *Result=ERR_SUCCESS;
+}
+
+//Walk a file's index tree once, filling in the data block of every index
+//below count.  Indexes with no block yet are left 0.
+void collectFileSectors(short DiskID,short SectorID,int indexlevel,int base,short *Sectors,int count){
+    if(indexlevel==0){
+        if(base<count){
+            Sectors[base]=SectorID;
+        }
+        return;
+    }
+    short IndexBlock[PGSIZE/2]={0};
+    BufferCacheRead(DiskID,SectorID,IndexBlock);
+    int span=GetMaxIndex(indexlevel-1);
+    for(int i=0;i<INDEX_BLOCK_FANOUT && base+i*span<count;i++){
+        if(IndexBlock[i]!=0){
+            collectFileSectors(DiskID, IndexBlock[i], indexlevel-1, base+i*span, Sectors, count);
+        }
+    }
+}
+
+//MAP_FILE: blocks the file doesn't have yet are written as zeros first, so
+//every page of the range has a sector to fault from and write back to.
+//Whatever the range held before is discarded.
+void MapFile(long Inode,long StartAddress,long Pages,long *Result){
+    MEMORY_MAPPED_IO mmio;
+    INT32 ProcessID=osGetCurrentProcessID();
+    PCB *pcb=GetProcessByID(ProcessID);
+    long StartPage=StartAddress/PGSIZE;
+    if(Inode<0 || Inode>=MAX_NUMBER_INODES || pcb->FileInode[Inode]==NULL
+       || StartAddress<0 || StartAddress%PGSIZE!=0 || Pages<=0 || StartPage+Pages>NUMBER_VIRTUAL_PAGES){
+        *Result=ERR_BAD_PARAM;
+        return;
+    }
+    for(FileMapping *other=FileMappings;other!=NULL;other=other->next){
+        if(other->Owner==pcb && StartPage<other->StartPage+other->Pages && other->StartPage<StartPage+Pages){
+            *Result=ERR_BAD_PARAM;
+            return;
+        }
+    }
+    mmio.Field1 = mmio.Field2 = mmio.Field3 = 0;
+    mmio.Mode=Z502GetPageTable;
+    MEM_READ(Z502Context, &mmio);
+    pcb->Pagetable=(UINT16 **)mmio.Field1;
+    Inodeinfo *inodeinfo=pcb->FileInode[Inode];
+    short *Sectors=(short *)calloc(Pages, sizeof(short));
+    collectFileSectors(inodeinfo->DiskID, inodeinfo->Index_Location, (inodeinfo->File_Description&6)>>1, 0, Sectors, Pages);
+    bool extended=false;
+    for(int i=0;i<Pages;i++){
+        if(Sectors[i]==0){
+            char zeros[PGSIZE]={0};
+            long WriteResult;
+            WriteFile(Inode, i, zeros, &WriteResult);
+            extended=true;
+        }
+    }
+    if(extended){
+        collectFileSectors(inodeinfo->DiskID, inodeinfo->Index_Location, (inodeinfo->File_Description&6)>>1, 0, Sectors, Pages);
+    }
+    KernelMutexAcquire(&PagerMutex);
+    for(int page=StartPage;page<StartPage+Pages;page++){
+        UINT16 *pte=GetPTE(pcb, page, false);
+        if(pte!=NULL && (*pte&PTBL_VALID_BIT)!=0){
+            int frame=*pte&PTBL_PHYS_PG_NO;
+            if(Frame[frame].Merged!=NULL){
+                UnmergeMapping(frame, pte);
+            }
+            else if(Frame[frame].PTE==pte){
+                releaseFrame(frame);
+            }
+        }
+        SwapDiscard(pcb->processID, page);
+        if(pte!=NULL){
+            *pte=0;
+            osFlushTLBEntry(pcb, page);
+        }
+    }
+    FileMapping *mapping=(FileMapping *)calloc(1, sizeof(FileMapping));
+    mapping->Owner=pcb;
+    mapping->Inode=Inode;
+    mapping->DiskID=inodeinfo->DiskID;
+    mapping->StartPage=StartPage;
+    mapping->Pages=Pages;
+    mapping->Sectors=Sectors;
+    mapping->next=FileMappings;
+    FileMappings=mapping;
+    KernelMutexRelease(&PagerMutex);
     *Result=ERR_SUCCESS;
 }
 
+void UnmapFile(long StartAddress,long *Result){
+    INT32 ProcessID=osGetCurrentProcessID();
+    PCB *pcb=GetProcessByID(ProcessID);
+    for(FileMapping *mapping=FileMappings;mapping!=NULL;mapping=mapping->next){
+        if(mapping->Owner==pcb && mapping->StartPage*PGSIZE==StartAddress){
+            KernelMutexAcquire(&PagerMutex);
+            FileMappingWriteBack(mapping, true);
+            FileMappingRemove(mapping);
+            KernelMutexRelease(&PagerMutex);
+            *Result=ERR_SUCCESS;
+            return;
+        }
+    }
+    *Result=ERR_BAD_PARAM;
+}
+
 void DirectoryContent(long *Result){
 //  Search along the cur directory and print the info of file or subdirectory
     INT32 ProcessID=osGetCurrentProcessID();
@@ -1463,8 +3868,8 @@ void DirectoryContent(long *Result){
     short DiskID=GetCurrentDiskID();
     for(int i=0;i<curDir->File_Size;i++){
         short SectorID=fetchIndexContent(curDir,i);
-        char *diskread[16];
-        osReadOnDisk(DiskID, SectorID, (long)diskread);
+        unsigned char diskread[PGSIZE];
+        BufferCacheRead(DiskID, SectorID, (char *)diskread);
         Header *head=convertReaddatatoHeader(diskread);
         long Inode=head->Inode;
         char FileName[7];
@@ -1506,7 +3911,6 @@ void svc(SYSTEM_CALL_DATA *SystemCallData) {
     static short do_print = 10;
     short i;
     INT32 Time;
-    MEMORY_MAPPED_IO mmio;
 
     call_type = (short) SystemCallData->SystemCallNumber;
     if (do_print > 0) {
@@ -1519,6 +3923,11 @@ void svc(SYSTEM_CALL_DATA *SystemCallData) {
         }
         do_print--;
     }
+//    File system calls may block on the disk part way through
+    bool filesystem=call_type>=SYSNUM_FORMAT && call_type<=SYSNUM_SYNC_DISK;
+    if(filesystem){
+        KernelMutexAcquire(&FileSystemMutex);
+    }
     switch (call_type) {
         case SYSNUM_GET_TIME_OF_DAY:
             *(long *)SystemCallData->Argument[0]=Get_CurrentTime();
@@ -1535,7 +3944,7 @@ void svc(SYSTEM_CALL_DATA *SystemCallData) {
         
         case SYSNUM_CREATE_PROCESS:
         {
-            void *PageTable = (void *) calloc(2, NUMBER_VIRTUAL_PAGES);
+            void *PageTable = (void *) AllocatePageDirectory();
             *SystemCallData->Argument[4]=osCreateProcess(CurrentProcessID, (char *)SystemCallData->Argument[0],(INT32)SystemCallData->Argument[2],(long)SystemCallData->Argument[1],(long)PageTable);
             
             if(*SystemCallData->Argument[4]==ERR_SUCCESS){
@@ -1563,57 +3972,11 @@ void svc(SYSTEM_CALL_DATA *SystemCallData) {
             break;
             
         case SYSNUM_PHYSICAL_DISK_READ:
-        {
-            mmio.Field2 = DEVICE_IN_USE;
-            while (mmio.Field2 != DEVICE_FREE) {
-                mmio.Mode = Z502Status;
-                mmio.Field1 = (INT16)SystemCallData->Argument[0];
-                mmio.Field2 = mmio.Field3 = 0;
-                MEM_READ(Z502Disk, &mmio);
-            }
-//            osReadOnDisk((INT16)SystemCallData->Argument[0],(INT16)SystemCallData->Argument[1],(long)SystemCallData->Argument[2]);
-            mmio.Mode=Z502DiskRead;
-            mmio.Field1=(INT16)SystemCallData->Argument[0];
-            mmio.Field2=(INT16)SystemCallData->Argument[1];
-            mmio.Field3=(long)SystemCallData->Argument[2];
-            mmio.Field4=0;
-            MEM_WRITE(Z502Disk, &mmio);
-            
-            INT32 CurrentProcessID=osGetCurrentProcessID();
-            PCB *pcb=GetProcessByID(CurrentProcessID);
-            pcb->DiskID=(INT16)SystemCallData->Argument[0];
-            QInsertOnTail(DiskQueueID, pcb);
-            osDispatcher();
-//            osCauseZ502Idle();
-//            osCauseZ502Idle();
-        }
+            osReadOnDisk((INT16)SystemCallData->Argument[0],(INT16)SystemCallData->Argument[1],(char *)SystemCallData->Argument[2]);
             break;
         
         case SYSNUM_PHYSICAL_DISK_WRITE:
-        {
-            mmio.Field2 = DEVICE_IN_USE;
-            while (mmio.Field2 != DEVICE_FREE) {
-                mmio.Mode = Z502Status;
-                mmio.Field1 = (INT16)SystemCallData->Argument[0];
-                mmio.Field2 = mmio.Field3 = 0;
-                MEM_READ(Z502Disk, &mmio);
-            }
-//            osWriteToDisk((INT16)SystemCallData->Argument[0],(INT16)SystemCallData->Argument[1],(long)SystemCallData->Argument[2]);
-            mmio.Mode=Z502DiskWrite;
-            mmio.Field1=(INT16)SystemCallData->Argument[0];
-            mmio.Field2=(INT16)SystemCallData->Argument[1];
-            mmio.Field3=(long)SystemCallData->Argument[2];
-            mmio.Field4=0;
-            MEM_WRITE(Z502Disk, &mmio);
-            
-            INT32 CurrentProcessID=osGetCurrentProcessID();
-            PCB *pcb=GetProcessByID(CurrentProcessID);
-            pcb->DiskID=(INT16)SystemCallData->Argument[0];
-            QInsertOnTail(DiskQueueID, pcb);
-            osDispatcher();
-//            osCauseZ502Idle();
-//            osCauseZ502Idle();
-        }
+            osWriteToDisk((INT16)SystemCallData->Argument[0],(INT16)SystemCallData->Argument[1],(char *)SystemCallData->Argument[2]);
             break;
             
         case SYSNUM_CHECK_DISK:
@@ -1621,6 +3984,9 @@ void svc(SYSTEM_CALL_DATA *SystemCallData) {
             break;
             
         case SYSNUM_DEFINE_SHARED_AREA:
+            KernelMutexAcquire(&PagerMutex);
+            DefineSharedArea((long)SystemCallData->Argument[0], (long)SystemCallData->Argument[1], (char *)SystemCallData->Argument[2], (INT32 *)SystemCallData->Argument[3], (INT32 *)SystemCallData->Argument[4]);
+            KernelMutexRelease(&PagerMutex);
             break;
             
         case SYSNUM_FORMAT:
@@ -1659,6 +4025,18 @@ void svc(SYSTEM_CALL_DATA *SystemCallData) {
         case SYSNUM_DIR_CONTENTS:
             DirectoryContent((long *)SystemCallData->Argument[0]);
             break;
+            
+        case SYSNUM_MAP_FILE:
+            MapFile((long)SystemCallData->Argument[0], (long)SystemCallData->Argument[1], (long)SystemCallData->Argument[2], (long *)SystemCallData->Argument[3]);
+            break;
+            
+        case SYSNUM_UNMAP_FILE:
+            UnmapFile((long)SystemCallData->Argument[0], (long *)SystemCallData->Argument[1]);
+            break;
+            
+        case SYSNUM_SYNC_DISK:
+            BufferCacheSync((long)SystemCallData->Argument[0], (long *)SystemCallData->Argument[1]);
+            break;
         
         case SYSNUM_MEM_READ:
             Z502MemoryRead((INT32)SystemCallData->Argument[0], (INT32 *)SystemCallData->Argument[1]);
@@ -1672,6 +4050,10 @@ void svc(SYSTEM_CALL_DATA *SystemCallData) {
             printf( "Call_type is - %i\n", call_type);
             break;
     }
+    if(filesystem){
+        BitMapFlush(-1);
+        KernelMutexRelease(&FileSystemMutex);
+    }
 }                                               // End of svc
 
 
@@ -1689,8 +4071,9 @@ void svc(SYSTEM_CALL_DATA *SystemCallData) {
 
 void osInit(int argc, char *argv[]) {
     // Every process will have a page table.  This will be used in
-    // the second half of the project.
-    void *PageTable = (void *) calloc(2, NUMBER_VIRTUAL_PAGES);
+    // the second half of the project.  Only the directory is allocated
+    // here; leaf tables are added by the fault handler as pages are used.
+    void *PageTable = (void *) AllocatePageDirectory();
     INT32 i;
     MEMORY_MAPPED_IO mmio;
     
@@ -1724,6 +4107,15 @@ void osInit(int argc, char *argv[]) {
         aprintf("Add an 'M' to the command line to invoke multiprocessor operation.\n\n");
     }
     
+    //  Find out whether the hardware has a TLB we must keep coherent
+    mmio.Mode = Z502Status;
+    mmio.Field1 = mmio.Field2 = mmio.Field3 = mmio.Field4 = 0;
+    MEM_READ(Z502TLB, &mmio);
+    TLBEntries = mmio.Field1;
+    
+    Frame=(struct Frame_Entry *)calloc(NUMBER_PHYSICAL_PAGES, sizeof(struct Frame_Entry));
+    FreeFrameCount=NUMBER_PHYSICAL_PAGES;
+    
     //  Some students have complained that their code is unable to allocate
     //  memory.  Who knows what's going on, other than the compiler has some
     //  wacky switch being used.  We try to allocate memory here and stop
@@ -1746,7 +4138,10 @@ void osInit(int argc, char *argv[]) {
     TimerQueueID=QCreate(TimerQueueName);
     PCBQueueID=QCreate(PCBQueueName);
     TerminatedQueueID=QCreate(TerminatedQueueName);
+    InactiveQueueID=QCreate(InactiveQueueName);
     TimerSuspendQ=QCreate(TimerSuspend);
+    PagerMutex.WaitQueueID=QCreate(PagerWaitQueueName);
+    FileSystemMutex.WaitQueueID=QCreate(FileSystemWaitQueueName);
     
     if ((argc > 1) && (strcmp(argv[1], "sample") == 0)) {
         mmio.Mode = Z502InitializeContext;
@@ -1765,7 +4160,7 @@ void osInit(int argc, char *argv[]) {
         // Field1 contains the value of the context returned in the last call
         // Suspends this current thread
         MaxSchedulePrint=10000;
-        PCB *pcb=(PCB*) malloc(sizeof(PCB));
+        PCB *pcb=(PCB*) calloc(1, sizeof(PCB));
         CurrentPCB=pcb;
         INT32 InitialProcessID=1;
         CurrentProcessID=InitialProcessID+1;
@@ -1781,7 +4176,7 @@ void osInit(int argc, char *argv[]) {
     
     if((argc > 1) && (strcmp(argv[1],"test2")==0)){
         MaxSchedulePrint=10000;
-        PCB *pcb=(PCB*) malloc(sizeof(PCB));
+        PCB *pcb=(PCB*) calloc(1, sizeof(PCB));
         CurrentPCB=pcb;
         INT32 InitialProcessID=1;
         CurrentProcessID=InitialProcessID+1;
@@ -1797,7 +4192,7 @@ void osInit(int argc, char *argv[]) {
     
     if((argc > 1) && (strcmp(argv[1],"test3")==0)){
         MaxSchedulePrint=10000;
-        PCB *pcb=(PCB*) malloc(sizeof(PCB));
+        PCB *pcb=(PCB*) calloc(1, sizeof(PCB));
         CurrentPCB=pcb;
         INT32 InitialProcessID=1;
         CurrentProcessID=InitialProcessID+1;
@@ -1816,7 +4211,7 @@ void osInit(int argc, char *argv[]) {
         INT32 InitialProcessID=1;
         CurrentProcessID=InitialProcessID+1;
         char processName[30]="test4";
-        PCB *pcb=(PCB*) malloc(sizeof(PCB));
+        PCB *pcb=(PCB*) calloc(1, sizeof(PCB));
         CurrentPCB=pcb;
         strcpy(pcb->processName,processName);
         pcb->processID=InitialProcessID;
@@ -1829,7 +4224,7 @@ void osInit(int argc, char *argv[]) {
     
     if((argc > 1) && (strcmp(argv[1],"test5")==0)){
         MaxSchedulePrint=10000;
-        PCB *pcb=(PCB*) malloc(sizeof(PCB));
+        PCB *pcb=(PCB*) calloc(1, sizeof(PCB));
         CurrentPCB=pcb;
         INT32 InitialProcessID=1;
         CurrentProcessID=InitialProcessID+1;
@@ -1845,7 +4240,7 @@ void osInit(int argc, char *argv[]) {
     }
     if((argc > 1) && (strcmp(argv[1],"test6")==0)){
         MaxSchedulePrint=10000;
-        PCB *pcb=(PCB*) malloc(sizeof(PCB));
+        PCB *pcb=(PCB*) calloc(1, sizeof(PCB));
         CurrentPCB=pcb;
         INT32 InitialProcessID=1;
         CurrentProcessID=InitialProcessID+1;
@@ -1860,7 +4255,7 @@ void osInit(int argc, char *argv[]) {
     }
     if((argc > 1) && (strcmp(argv[1],"test7")==0)){
         MaxSchedulePrint=10000;
-        PCB *pcb=(PCB*) malloc(sizeof(PCB));
+        PCB *pcb=(PCB*) calloc(1, sizeof(PCB));
         CurrentPCB=pcb;
         INT32 InitialProcessID=1;
         char processName[30]="test7";
@@ -1876,7 +4271,7 @@ void osInit(int argc, char *argv[]) {
     
     if((argc > 1) && (strcmp(argv[1],"test8")==0)){
         MaxSchedulePrint=10000;
-        PCB *pcb=(PCB*) malloc(sizeof(PCB));
+        PCB *pcb=(PCB*) calloc(1, sizeof(PCB));
         CurrentPCB=pcb;
         INT32 InitialProcessID=1;
         char processName[30]="test8";
@@ -1894,7 +4289,7 @@ void osInit(int argc, char *argv[]) {
         MaxSchedulePrint=10000;
         MaxSentTime=9;
         MessageQueueID=QCreate(MessageQueueName);
-        PCB *pcb=(PCB*) malloc(sizeof(PCB));
+        PCB *pcb=(PCB*) calloc(1, sizeof(PCB));
         CurrentPCB=pcb;
         INT32 InitialProcessID=1;
         char processName[30]="test9";
@@ -1913,7 +4308,7 @@ void osInit(int argc, char *argv[]) {
         MaxSentTime=15;
         MessageSuspendedQ=QCreate(MessageSuspendedQueueName);
         MessageQueueID=QCreate(MessageQueueName);
-        PCB *pcb=(PCB*) malloc(sizeof(PCB));
+        PCB *pcb=(PCB*) calloc(1, sizeof(PCB));
         CurrentPCB=pcb;
         INT32 InitialProcessID=1;
         char processName[30]="test10";
@@ -1930,8 +4325,7 @@ void osInit(int argc, char *argv[]) {
     
     if((argc > 1) && (strcmp(argv[1],"test11")==0)){
         MaxSchedulePrint=50;
-        DiskQueueID=QCreate(DiskQueueName);
-        PCB *pcb=(PCB*) malloc(sizeof(PCB));
+        PCB *pcb=(PCB*) calloc(1, sizeof(PCB));
         CurrentPCB=pcb;
         INT32 InitialProcessID=1;
         char processName[30]="test11";
@@ -1947,7 +4341,7 @@ void osInit(int argc, char *argv[]) {
     
     if((argc > 1) && (strcmp(argv[1],"test12")==0)){
         MaxSchedulePrint=50;
-        PCB *pcb=(PCB*) malloc(sizeof(PCB));
+        PCB *pcb=(PCB*) calloc(1, sizeof(PCB));
         CurrentPCB=pcb;
         INT32 InitialProcessID=1;
         char processName[30]="test12";
@@ -1963,8 +4357,7 @@ void osInit(int argc, char *argv[]) {
     
     if((argc > 1) && (strcmp(argv[1],"test13")==0)){
         MaxSchedulePrint=50;
-        DiskQueueID=QCreate(DiskQueueName);
-        PCB *pcb=(PCB*) malloc(sizeof(PCB));
+        PCB *pcb=(PCB*) calloc(1, sizeof(PCB));
         CurrentPCB=pcb;
         INT32 InitialProcessID=1;
         char processName[30]="test13";
@@ -1981,8 +4374,7 @@ void osInit(int argc, char *argv[]) {
     
     if((argc > 1) && (strcmp(argv[1],"test14")==0)){
         MaxSchedulePrint=100;
-        DiskQueueID=QCreate(DiskQueueName);
-        PCB *pcb=(PCB*) malloc(sizeof(PCB));
+        PCB *pcb=(PCB*) calloc(1, sizeof(PCB));
         CurrentPCB=pcb;
         INT32 InitialProcessID=1;
         char processName[30]="test14";
@@ -1997,7 +4389,7 @@ void osInit(int argc, char *argv[]) {
     }
     
     if((argc > 1) && (strcmp(argv[1],"test21")==0)){
-        PCB *pcb=(PCB*) malloc(sizeof(PCB));
+        PCB *pcb=(PCB*) calloc(1, sizeof(PCB));
         CurrentPCB=pcb;
         INT32 InitialProcessID=1;
         char processName[30]="test21";
@@ -2012,7 +4404,7 @@ void osInit(int argc, char *argv[]) {
     }
     
     if((argc > 1) && (strcmp(argv[1],"test22")==0)){
-        PCB *pcb=(PCB*) malloc(sizeof(PCB));
+        PCB *pcb=(PCB*) calloc(1, sizeof(PCB));
         CurrentPCB=pcb;
         INT32 InitialProcessID=1;
         char processName[30]="test22";
@@ -2027,7 +4419,7 @@ void osInit(int argc, char *argv[]) {
     }
     
     if((argc > 1) && (strcmp(argv[1],"test23")==0)){
-        PCB *pcb=(PCB*) malloc(sizeof(PCB));
+        PCB *pcb=(PCB*) calloc(1, sizeof(PCB));
         CurrentPCB=pcb;
         INT32 InitialProcessID=1;
         char processName[30]="test23";
@@ -2042,7 +4434,7 @@ void osInit(int argc, char *argv[]) {
     }
     
     if((argc > 1) && (strcmp(argv[1],"test24")==0)){
-        PCB *pcb=(PCB*) malloc(sizeof(PCB));
+        PCB *pcb=(PCB*) calloc(1, sizeof(PCB));
         CurrentPCB=pcb;
         INT32 InitialProcessID=1;
         char processName[30]="test24";
@@ -2057,7 +4449,7 @@ void osInit(int argc, char *argv[]) {
     }
     
     if((argc > 1) && (strcmp(argv[1],"test25")==0)){
-        PCB *pcb=(PCB*) malloc(sizeof(PCB));
+        PCB *pcb=(PCB*) calloc(1, sizeof(PCB));
         CurrentPCB=pcb;
         INT32 InitialProcessID=1;
         char processName[30]="test25";
@@ -2072,7 +4464,7 @@ void osInit(int argc, char *argv[]) {
     }
     
     if((argc > 1) && (strcmp(argv[1],"test26")==0)){
-        PCB *pcb=(PCB*) malloc(sizeof(PCB));
+        PCB *pcb=(PCB*) calloc(1, sizeof(PCB));
         CurrentPCB=pcb;
         INT32 InitialProcessID=1;
         char processName[30]="test26";
@@ -2087,7 +4479,7 @@ void osInit(int argc, char *argv[]) {
     }
     
     if((argc > 1) && (strcmp(argv[1],"test41")==0)){
-        PCB *pcb=(PCB*) malloc(sizeof(PCB));
+        PCB *pcb=(PCB*) calloc(1, sizeof(PCB));
         CurrentPCB=pcb;
         INT32 InitialProcessID=1;
         char processName[30]="test41";
@@ -2102,7 +4494,7 @@ void osInit(int argc, char *argv[]) {
     }
     
     if((argc > 1) && (strcmp(argv[1],"test42")==0)){
-        PCB *pcb=(PCB*) malloc(sizeof(PCB));
+        PCB *pcb=(PCB*) calloc(1, sizeof(PCB));
         CurrentPCB=pcb;
         INT32 InitialProcessID=1;
         char processName[30]="test42";
@@ -2117,7 +4509,7 @@ void osInit(int argc, char *argv[]) {
     }
     
     if((argc > 1) && (strcmp(argv[1],"test43")==0)){
-        PCB *pcb=(PCB*) malloc(sizeof(PCB));
+        PCB *pcb=(PCB*) calloc(1, sizeof(PCB));
         CurrentPCB=pcb;
         INT32 InitialProcessID=1;
         char processName[30]="test26";
@@ -2132,7 +4524,7 @@ void osInit(int argc, char *argv[]) {
     }
     
     if((argc > 1) && (strcmp(argv[1],"test44")==0)){
-        PCB *pcb=(PCB*) malloc(sizeof(PCB));
+        PCB *pcb=(PCB*) calloc(1, sizeof(PCB));
         CurrentPCB=pcb;
         INT32 InitialProcessID=1;
         char processName[30]="test44";
@@ -2147,7 +4539,7 @@ void osInit(int argc, char *argv[]) {
     }
     
     if((argc > 1) && (strcmp(argv[1],"test45")==0)){
-        PCB *pcb=(PCB*) malloc(sizeof(PCB));
+        PCB *pcb=(PCB*) calloc(1, sizeof(PCB));
         CurrentPCB=pcb;
         INT32 InitialProcessID=1;
         char processName[30]="test45";
@@ -2162,7 +4554,7 @@ void osInit(int argc, char *argv[]) {
     }
     
     if((argc > 1) && (strcmp(argv[1],"test46")==0)){
-        PCB *pcb=(PCB*) malloc(sizeof(PCB));
+        PCB *pcb=(PCB*) calloc(1, sizeof(PCB));
         CurrentPCB=pcb;
         INT32 InitialProcessID=1;
         char processName[30]="test46";
@@ -2176,6 +4568,36 @@ void osInit(int argc, char *argv[]) {
         osStartContext(ContextID);
     }
     
+    if((argc > 1) && (strcmp(argv[1],"test49")==0)){
+        PCB *pcb=(PCB*) calloc(1, sizeof(PCB));
+        CurrentPCB=pcb;
+        INT32 InitialProcessID=1;
+        char processName[30]="test49";
+        strcpy(pcb->processName,processName);
+        pcb->processID=InitialProcessID;
+        pcb->processPriority=NORMAL_PRIORITY;
+        long ContextID=osInitailizeContext((long) test49,(long) PageTable);
+        pcb->currentContext=ContextID;
+        CurrentProcessID=InitialProcessID+1;
+        QInsertOnTail(PCBQueueID, pcb);
+        osStartContext(ContextID);
+    }
+    
+    if((argc > 1) && (strcmp(argv[1],"test50")==0)){
+        PCB *pcb=(PCB*) calloc(1, sizeof(PCB));
+        CurrentPCB=pcb;
+        INT32 InitialProcessID=1;
+        char processName[30]="test50";
+        strcpy(pcb->processName,processName);
+        pcb->processID=InitialProcessID;
+        pcb->processPriority=NORMAL_PRIORITY;
+        long ContextID=osInitailizeContext((long) test50,(long) PageTable);
+        pcb->currentContext=ContextID;
+        CurrentProcessID=InitialProcessID+1;
+        QInsertOnTail(PCBQueueID, pcb);
+        osStartContext(ContextID);
+    }
+    
     // End of handler for sample code - This routine should never return here
     //  By default test0 runs if no arguments are given on the command line
     //  Creation and Switching of contexts should be done in a separate routine.
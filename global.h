@@ -65,12 +65,26 @@ typedef         int                             BOOL;
  These parameters define the memory structure and page table
  mechanism.
  ***************************************************************************/
-// How many physical pages of memory exist in the Z502
-#define    NUMBER_PHYSICAL_PAGES           (short)64
+// How many physical pages of memory exist in the Z502.  This is set
+// when the simulator starts (the -frames option, see Z502Configure)
+// and can be anything up to what the PTE frame number field can hold.
+extern INT32 Z502PhysicalPages;
+#define    NUMBER_PHYSICAL_PAGES           Z502PhysicalPages
+#define    DEFAULT_NUMBER_PHYSICAL_PAGES    64
+#define    MAX_NUMBER_PHYSICAL_PAGES        (PTBL_PHYS_PG_NO + 1)
 // How many virtual pages of memory exist in the Z502
+// Both of these may be overridden when building, e.g. -DPGSIZE=256
+#ifndef    NUMBER_VIRTUAL_PAGES
 #define    NUMBER_VIRTUAL_PAGES             1024
-// The number of bytes in a page
+#endif
+// The number of bytes in a page; this is also the disk sector size
+#ifndef    PGSIZE
 #define    PGSIZE                           (short)16
+#endif
+// Page tables are two level: a directory of pointers to leaf tables,
+// each leaf holding the entries for PTBL_LEAF_ENTRIES virtual pages
+#define    PTBL_LEAF_ENTRIES                64
+#define    PTBL_DIRECTORY_ENTRIES           (NUMBER_VIRTUAL_PAGES / PTBL_LEAF_ENTRIES)
 
 /***************************************************************************
  Meaning of locations in a page table entry
@@ -81,10 +95,13 @@ typedef         int                             BOOL;
 #define         PTBL_VALID_BIT                  0x8000
 #define         PTBL_MODIFIED_BIT               0x4000
 #define         PTBL_REFERENCED_BIT             0x2000
-#define         PTBL_PHYS_PG_NO                 0x0FFF
+// A write to a valid page with this bit set takes an INVALID_MEMORY fault
+#define         PTBL_READ_ONLY_BIT              0x0800
+#define         PTBL_PHYS_PG_NO                 0x07FF
 
 //     These are the memory mapped IO Functions
 
+#define      Z502TLB                   Z502Halt+1
 #define      Z502Halt                  Z502Idle+1
 #define      Z502Idle                  Z502InterruptDevice+1
 #define      Z502InterruptDevice       Z502Clock+1
@@ -111,6 +128,8 @@ typedef         int                             BOOL;
 #define      Z502GetCurrentContext        12
 #define      Z502SetProcessorNumber       13
 #define      Z502GetProcessorNumber       14
+#define      Z502FlushTLBEntry            15
+#define      Z502FlushTLB                 16
 
 // This is the memory Mapped IO Data Structure.  It is an integral
 // part of all Mapped IO.  It's required that this be filled in by
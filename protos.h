@@ -91,6 +91,8 @@ void   test45( void );
 void   test46( void );
 void   test47( void );
 void   test48( void );
+void   test49( void );
+void   test50( void );
 
 void   GetSkewedRandomNumber( long*, long, long );   // Used by sample.c
 
@@ -100,12 +102,15 @@ void   GetSkewedRandomNumber( long*, long, long );   // Used by sample.c
 // Some of these entries are used only by the main() in test.c
 
 void   GoToExit(int );
+void   Z502Configure(int *, char *[]);
 void   Z502CreateUserThread( void *);
 //void   Z502Halt( void );                            //MAKE MEMORYMAPPED IO
 //void   Z502Idle( void );                            // MAKE MEMORY MAPPED IO
 void   SoftwareTrap(SYSTEM_CALL_DATA *SystemCallData);
 void   Z502MemoryRead(INT32, INT32 * );
 void   Z502MemoryWrite(INT32, INT32 * );
+void   Z502MemoryReadBlock(INT32, char *, INT32 );
+void   Z502MemoryWriteBlock(INT32, char *, INT32 );
 void   Z502ReadPhysicalMemory( INT32, char *);
 void   Z502WritePhysicalMemory( INT32, char *);
 void   *Z502PrepareProcessForExecution( void );
@@ -70,7 +70,7 @@ void SampleCode(void) {
     long Value;
     MEMORY_MAPPED_IO mmio;        // Structure used for hardware interface
     
-    short *PAGE_TBL_ADDR;
+    UINT16 **PAGE_DIRECTORY;
     
     INT32 disk_id, sector; /* Used for disk requests */
     char disk_buffer_write[PGSIZE ];
@@ -433,11 +433,14 @@ void SampleCode(void) {
     mmio.Mode = Z502GetPageTable;
     mmio.Field1 = mmio.Field2 = mmio.Field3 = 0;
     MEM_READ(Z502Context, &mmio);
-    PAGE_TBL_ADDR = (short *) mmio.Field1;   // Gives us the page table
-    // Set to VALID the logical page 0 and have it point at physical
+    PAGE_DIRECTORY = (UINT16 **) mmio.Field1;  // Gives us the page directory
+    // Logical page 0 lives in the first leaf table; give it one, then
+    // set to VALID the logical page 0 and have it point at physical
     // frame 0.
+    if (PAGE_DIRECTORY[0] == NULL)
+        PAGE_DIRECTORY[0] = (UINT16 *) calloc(PTBL_LEAF_ENTRIES, sizeof(UINT16));
     i = PTBL_VALID_BIT;
-    PAGE_TBL_ADDR[0] = (UINT16) i;
+    PAGE_DIRECTORY[0][0] = (UINT16) i;
     i = 73;                   // Data to be written
     MEM_WRITE(0, &i);
     MEM_READ(0, &j);          // Now read it back
@@ -243,17 +243,20 @@ short SPDoOutput(char *text) {
  in syscalls.h  An example of the use of this code is found in sample.c
  ****************************************************************************/
 
+// The memory printout has a fixed width, whatever the memory size
+#define    MP_FRAME_COLUMNS    64
+
 short MPPrintLine(MP_INPUT_DATA *Input) {
     char OutputLine[1200];
     INT32 index;
     INT32 Temporary;
     char temp[120];
-    char output_line3[NUMBER_PHYSICAL_PAGES + 5];
-    char output_line4[NUMBER_PHYSICAL_PAGES + 5];
-    char output_line5[NUMBER_PHYSICAL_PAGES + 5];
-    char output_line6[NUMBER_PHYSICAL_PAGES + 5];
-    char output_line7[NUMBER_PHYSICAL_PAGES + 5];
-    char output_line8[NUMBER_PHYSICAL_PAGES + 5];
+    char output_line3[MP_FRAME_COLUMNS + 5];
+    char output_line4[MP_FRAME_COLUMNS + 5];
+    char output_line5[MP_FRAME_COLUMNS + 5];
+    char output_line6[MP_FRAME_COLUMNS + 5];
+    char output_line7[MP_FRAME_COLUMNS + 5];
+    char output_line8[MP_FRAME_COLUMNS + 5];
     
     //  Header Line
     strcpy(OutputLine, "\n                       PHYSICAL MEMORY STATE\n");
@@ -274,7 +277,9 @@ short MPPrintLine(MP_INPUT_DATA *Input) {
     
     // Here we take the input data and arrange it artfully for our output
     
-    for (index = 0; index < NUMBER_PHYSICAL_PAGES ; index++) {
+    // There are only columns for the first MP_FRAME_COLUMNS frames
+    for (index = 0; index < NUMBER_PHYSICAL_PAGES && index < MP_FRAME_COLUMNS;
+         index++) {
         if (Input->frames[index].InUse == TRUE) {
             output_line3[index] = (char) (Input->frames[index].Pid + 48);
             Temporary = Input->frames[index].LogicalPage;
@@ -59,6 +59,9 @@
 #define         SYSNUM_DIR_CONTENTS                    25
 #define         SYSNUM_DELETE_DIR                      26
 #define         SYSNUM_DELETE_FILE                     27
+#define         SYSNUM_MAP_FILE                        28
+#define         SYSNUM_UNMAP_FILE                      29
+#define         SYSNUM_SYNC_DISK                       30
 
 // This structure defines the format used for all system calls.
 // For each call, the structure is filled in and then its address
@@ -105,6 +108,13 @@ fff;                                            \
 
 #define    MEM_WRITE( arg1, arg2 )   Z502MemoryWrite( arg1, (INT32 *)arg2 )
 
+//  Move arg3 bytes starting at virtual address arg1 in one call
+#define    MEM_READ_BLOCK( arg1, arg2, arg3 )                                  \
+Z502MemoryReadBlock( arg1, (char *)arg2, arg3 )
+
+#define    MEM_WRITE_BLOCK( arg1, arg2, arg3 )                                 \
+Z502MemoryWriteBlock( arg1, (char *)arg2, arg3 )
+
 #define    READ_MODIFY( arg1, arg2, arg3, arg4 )                               \
 Z502MemoryReadModify( arg1, arg2, arg3, arg4 )
 
@@ -439,6 +449,47 @@ SoftwareTrap(SystemCallData);                                 \
 free(SystemCallData);                                         \
 }
 
+//  Map arg3 pages of open file arg1 at virtual address arg2; block i of
+//  the file appears at page i of the range.  UNMAP_FILE takes the address.
+#define         MAP_FILE( arg1, arg2, arg3, arg4 )      {                     \
+SYSTEM_CALL_DATA *SystemCallData =                            \
+(SYSTEM_CALL_DATA *)calloc(1, sizeof(SYSTEM_CALL_DATA)); \
+SystemCallData->NumberOfArguments = 5;                        \
+SystemCallData->SystemCallNumber = SYSNUM_MAP_FILE;           \
+SystemCallData->Argument[0] = (long *)arg1;                   \
+SystemCallData->Argument[1] = (long *)arg2;                   \
+SystemCallData->Argument[2] = (long *)arg3;                   \
+SystemCallData->Argument[3] = (long *)arg4;                   \
+ChargeTimeAndCheckEvents( COST_OF_SOFTWARE_TRAP );            \
+SoftwareTrap(SystemCallData);                                 \
+free(SystemCallData);                                         \
+}
+
+#define         UNMAP_FILE( arg1, arg2 )      {                               \
+SYSTEM_CALL_DATA *SystemCallData =                            \
+(SYSTEM_CALL_DATA *)calloc(1, sizeof(SYSTEM_CALL_DATA)); \
+SystemCallData->NumberOfArguments = 3;                        \
+SystemCallData->SystemCallNumber = SYSNUM_UNMAP_FILE;         \
+SystemCallData->Argument[0] = (long *)arg1;                   \
+SystemCallData->Argument[1] = (long *)arg2;                   \
+ChargeTimeAndCheckEvents( COST_OF_SOFTWARE_TRAP );            \
+SoftwareTrap(SystemCallData);                                 \
+free(SystemCallData);                                         \
+}
+
+//  Write the sectors cached for disk arg1 (every disk if -1) back to it
+#define         SYNC_DISK( arg1, arg2 )      {                                \
+SYSTEM_CALL_DATA *SystemCallData =                            \
+(SYSTEM_CALL_DATA *)calloc(1, sizeof(SYSTEM_CALL_DATA)); \
+SystemCallData->NumberOfArguments = 3;                        \
+SystemCallData->SystemCallNumber = SYSNUM_SYNC_DISK;          \
+SystemCallData->Argument[0] = (long *)arg1;                   \
+SystemCallData->Argument[1] = (long *)arg2;                   \
+ChargeTimeAndCheckEvents( COST_OF_SOFTWARE_TRAP );            \
+SoftwareTrap(SystemCallData);                                 \
+free(SystemCallData);                                         \
+}
+
 /*      This section includes items needed in the scheduler printer.
  It's also useful for those routines that want to communicate
  with the scheduler printer.                                       */
@@ -485,6 +536,6 @@ typedef struct {
 #define   FRAME_REFERENCED 1
 
 typedef struct {
-    MP_FRAME_DATA  frames[NUMBER_PHYSICAL_PAGES];
+    MP_FRAME_DATA  frames[MAX_NUMBER_PHYSICAL_PAGES];
 } MP_INPUT_DATA;
 #endif
@@ -1758,7 +1758,7 @@ void testZ(void) {
     long EndingTime;
     long ErrorReturned;
     char Directoryname[8], Filename[8];
-    char WriteBuffer[16], ReadBuffer[16];
+    char WriteBuffer[PGSIZE], ReadBuffer[PGSIZE];
     int Index, Index2;
     int WhichFile;
     long DiskID = 1;
@@ -2706,6 +2706,171 @@ void testS(void) {
     TERMINATE_PROCESS(-1, &ErrorReturned);
     
 }                                // End of testS
+
+/**************************************************************************
+ Test49 exercises MEM_WRITE_BLOCK and MEM_READ_BLOCK.
+ 
+ A block that starts in the middle of a page and spans several pages is
+ written, read back as a block and word by word, and then read again
+ after enough other pages have been touched to push it out of memory,
+ so that the block transfer has to fault its pages back in.
+ **************************************************************************/
+
+#define         BLOCK_49_START          (3 * PGSIZE + PGSIZE / 2)
+#define         BLOCK_49_LENGTH         (4 * PGSIZE + 8)
+#define         FILLER_49_START_PAGE    256
+#define         FILLER_49_PAGES         (2 * DEFAULT_NUMBER_PHYSICAL_PAGES)
+
+void test49(void) {
+    long OurProcessID;
+    long ErrorReturned;
+    long Errors = 0;
+    INT32 DataWritten;
+    INT32 DataRead;
+    INT32 Word;
+    int i, Pass;
+    char BlockWritten[BLOCK_49_LENGTH];
+    char BlockRead[BLOCK_49_LENGTH];
+    
+    GET_PROCESS_ID("", &OurProcessID, &ErrorReturned);
+    aprintf("Release %s: test49: Pid %ld\n", TEST_VERSION, OurProcessID);
+    
+    for (Pass = 0; Pass < 2; Pass++) {
+        // Pass 0 writes to pages never touched before; pass 1 writes to
+        // pages that were pushed out by the filler loop of pass 0.
+        for (i = 0; i < BLOCK_49_LENGTH; i++)
+            BlockWritten[i] = (char) (OurProcessID + 7 * i + Pass);
+        MEM_WRITE_BLOCK(BLOCK_49_START, BlockWritten, BLOCK_49_LENGTH);
+        
+        memset(BlockRead, 0, BLOCK_49_LENGTH);
+        MEM_READ_BLOCK(BLOCK_49_START, BlockRead, BLOCK_49_LENGTH);
+        if (memcmp(BlockRead, BlockWritten, BLOCK_49_LENGTH) != 0) {
+            aprintf("Test49: block read back differs on pass %d\n", Pass);
+            Errors++;
+        }
+        for (i = 0; i < BLOCK_49_LENGTH; i += sizeof(INT32)) {
+            MEM_READ(BLOCK_49_START + i, &DataRead);
+            memcpy(&Word, &BlockWritten[i], sizeof(INT32));
+            if (DataRead != Word) {
+                aprintf("Test49: word at %d differs on pass %d\n",
+                        BLOCK_49_START + i, Pass);
+                Errors++;
+            }
+        }
+        
+        // Touch enough other pages that the block can't stay resident
+        for (i = 0; i < FILLER_49_PAGES; i++) {
+            DataWritten = i;
+            MEM_WRITE((FILLER_49_START_PAGE + i) * PGSIZE, &DataWritten);
+        }
+        
+        memset(BlockRead, 0, BLOCK_49_LENGTH);
+        MEM_READ_BLOCK(BLOCK_49_START, BlockRead, BLOCK_49_LENGTH);
+        if (memcmp(BlockRead, BlockWritten, BLOCK_49_LENGTH) != 0) {
+            aprintf("Test49: block read after page-out differs on pass %d\n",
+                    Pass);
+            Errors++;
+        }
+    }
+    if (Errors != 0)
+        aprintf("AN ERROR HAS OCCURRED.\n");
+    else
+        aprintf("Test49: block reads and writes were all correct\n");
+    TERMINATE_PROCESS(-1, &ErrorReturned);
+}                   // End of test49
+
+/**************************************************************************
+ Test50 exercises MAP_FILE and UNMAP_FILE.
+ 
+ A file is written with WRITE_FILE and then mapped over more pages than
+ it has blocks.  The mapped pages must show the file's blocks, and the
+ pages past its end must read as zeros.  Some pages are changed through
+ memory, the file is unmapped, and every block is read back with
+ READ_FILE to check that the changes reached the file.
+ **************************************************************************/
+
+#define         FILE_50_BLOCKS          12
+#define         MAP_50_PAGES            16
+#define         MAP_50_START_PAGE       64
+
+void test50(void) {
+    long OurProcessID;
+    long DiskID = 3;
+    long ErrorReturned;
+    long Inode;
+    long Errors = 0;
+    long MapAddress = MAP_50_START_PAGE * PGSIZE;
+    INT32 DataWritten;
+    INT32 DataRead;
+    INT32 Expected;
+    int Index, Index2;
+    char WriteBuffer[PGSIZE];
+    char ReadBuffer[PGSIZE];
+    char ExpectedBlock[MAP_50_PAGES][PGSIZE];
+    
+    GET_PROCESS_ID("", &OurProcessID, &ErrorReturned);
+    aprintf("Release %s: test50: Pid %ld\n", TEST_VERSION, OurProcessID);
+    
+    FORMAT(DiskID, &ErrorReturned);
+    SuccessExpected(ErrorReturned, "FORMAT");
+    OPEN_DIR(DiskID, "root", &ErrorReturned);
+    SuccessExpected(ErrorReturned, "OPEN_DIR of root");
+    OPEN_FILE("Test50", &Inode, &ErrorReturned);
+    SuccessExpected(ErrorReturned, "OPEN_FILE");
+    
+    memset(ExpectedBlock, 0, sizeof(ExpectedBlock));
+    for (Index = 0; Index < FILE_50_BLOCKS; Index++) {
+        for (Index2 = 0; Index2 < PGSIZE; Index2++)
+            WriteBuffer[Index2] = (char) (3 * Index + Index2 + 1);
+        WRITE_FILE(Inode, (long) Index, &WriteBuffer, &ErrorReturned);
+        SuccessExpected(ErrorReturned, "WRITE_FILE");
+        memcpy(ExpectedBlock[Index], WriteBuffer, PGSIZE);
+    }
+    
+    MAP_FILE(Inode, MapAddress, MAP_50_PAGES, &ErrorReturned);
+    SuccessExpected(ErrorReturned, "MAP_FILE");
+    
+    // The mapping shows the file, and zeros past its last block
+    for (Index = 0; Index < MAP_50_PAGES; Index++) {
+        for (Index2 = 0; Index2 < PGSIZE; Index2 += sizeof(INT32)) {
+            MEM_READ(MapAddress + Index * PGSIZE + Index2, &DataRead);
+            memcpy(&Expected, &ExpectedBlock[Index][Index2], sizeof(INT32));
+            if (DataRead != Expected) {
+                aprintf("Test50: mapped page %d offset %d reads %d, not %d\n",
+                        Index, Index2, DataRead, Expected);
+                Errors++;
+            }
+        }
+    }
+    
+    // Dirty every other page, including some past the old end of file
+    for (Index = 1; Index < MAP_50_PAGES; Index += 2) {
+        DataWritten = 1000 * OurProcessID + Index;
+        MEM_WRITE(MapAddress + Index * PGSIZE, &DataWritten);
+        memcpy(&ExpectedBlock[Index][0], &DataWritten, sizeof(INT32));
+    }
+    
+    UNMAP_FILE(MapAddress, &ErrorReturned);
+    SuccessExpected(ErrorReturned, "UNMAP_FILE");
+    
+    for (Index = 0; Index < MAP_50_PAGES; Index++) {
+        READ_FILE(Inode, (long) Index, &ReadBuffer, &ErrorReturned);
+        SuccessExpected(ErrorReturned, "READ_FILE");
+        if (memcmp(ReadBuffer, ExpectedBlock[Index], PGSIZE) != 0) {
+            aprintf("Test50: block %d of the file doesn't hold the mapped data\n",
+                    Index);
+            Errors++;
+        }
+    }
+    CLOSE_FILE(Inode, &ErrorReturned);
+    SuccessExpected(ErrorReturned, "CLOSE_FILE");
+    
+    if (Errors != 0)
+        aprintf("AN ERROR HAS OCCURRED.\n");
+    else
+        aprintf("Test50: mapped file reads and write-backs were all correct\n");
+    TERMINATE_PROCESS(-1, &ErrorReturned);
+}                   // End of test50
 /**************************************************************************
  
  test44_Statistics   This is designed to give an overview of how the
@@ -2809,6 +2974,8 @@ void testStartCode() {
  *****************************************************************/
 int main(int argc, char *argv[]) {
     int i;
+    // Take out the hardware options before anything touches the hardware
+    Z502Configure(&argc, argv);
     for (i = 0; i < MAX_NUMBER_OF_USER_THREADS; i++) {
         Z502CreateUserThread(testStartCode);
     }
@@ -117,7 +117,15 @@ Z502CONTEXT *GetCurrentContext();
 int GetLock(UINT32 RequestedMutex, char *CallingRoutine);
 INT16 GetMode(char *CallerLocation);
 void GetNextEventTime(INT32 *);
-UINT16 *GetPageTableAddress();
+UINT16 **GetPageTableAddress();
+UINT16 *GetPageTableEntry(INT16 VirtualPageNumber);
+UINT16 *LookupTranslation(int, Z502CONTEXT *, INT16);
+void InsertTranslation(int, Z502CONTEXT *, INT16, UINT16 *);
+void InvalidateTranslations(Z502CONTEXT *);
+int TlbProcessor(int);
+TLB_ENTRY *TlbLookup(int, Z502CONTEXT *, INT16);
+void TlbFill(int, Z502CONTEXT *, INT16, UINT16);
+void TlbFlush(int, Z502CONTEXT *, INT16, BOOL);
 int GetProcessorID();
 void GetProcessTimeUsage( unsigned long long *,
                          unsigned long long *,
@@ -140,8 +148,11 @@ void HardwareFault(INT16, INT16);
 void HardwareInternalPanic(INT32);
 void IdleSimulation();
 void MakeContext(long *ReturningContextPointer, long starting_address,
-                 UINT16* PageTable, BOOL user_or_kernel);
+                 UINT16** PageTable, BOOL user_or_kernel);
 void MemoryCommon(INT32, char *, BOOL);
+BOOL MemoryFastPath(INT32, char *, BOOL);
+void MemoryBlockCommon(INT32, char *, INT32, BOOL);
+INT32 TranslatePage(INT16, INT32, BOOL);
 void PhysicalMemoryCommon(INT32, char *, BOOL);
 void MemoryMappedIO(INT32, MEMORY_MAPPED_IO *, BOOL);
 void PrintRingBuffer(void);
@@ -154,7 +165,7 @@ void ResumeProcessExecution(Z502CONTEXT *Context);
 void SaveTimeOfCall(int SystemCallNumber);
 void SetCurrentContext(Z502CONTEXT *Address);
 void SetMode(char *CallerLocation, INT16 mode);
-void SetPageTableAddress(UINT16 *address);
+void SetPageTableAddress(UINT16 **address);
 int SignalCondition(UINT32 Condition, char* CallingRoutine);
 void SoftwareTrap(SYSTEM_CALL_DATA *SystemCallData);
 void SuspendProcessExecution(Z502CONTEXT *Context);
@@ -175,7 +186,9 @@ void *TO_VECTOR[TO_VECTOR_TYPES ];
  *****************************************************************/
 
 // This is the definition of the physical memory supported by the hardware
-char MEMORY[NUMBER_PHYSICAL_PAGES * PGSIZE ];
+// It's allocated by Z502Init once the number of frames is known.
+INT32 Z502PhysicalPages = DEFAULT_NUMBER_PHYSICAL_PAGES;
+char *MEMORY = NULL;
 
 // The hardware keeps track of the address of the context currently being run
 //Z502CONTEXT *Z502_CURRENT_CONTEXT[MAX_NUMBER_OF_PROCESSORS ];
@@ -221,6 +234,8 @@ INT32 EventLock = -1;                          // Change from UINT32 - 08/2012
 INT32 InterruptLock = -1;
 INT32 HardwareLock = -1;
 INT32 ThreadTableLock = -1;
+INT32 ClockLock = -1;
+INT32 MemoryStripeLock[MEMORY_LOCK_STRIPES];
 INT32 SPPrintLock = -1;
 INT32 MPPrintLock = -1;
 
@@ -233,6 +248,39 @@ int ChangePriorityTimeOfFirstCall = 0;
 // Contains info about all the threads created
 THREAD_INFO ThreadTable[MAX_THREAD_TABLE_SIZE];
 
+// Per processor translation cache, indexed by virtual page number
+TRANSLATION_CACHE_ENTRY TranslationCache[MAX_THREAD_TABLE_SIZE][TRANSLATION_CACHE_SIZE];
+
+// Counted per processor since the fast path runs without HardwareLock
+INT32 FastPathAccesses[MAX_THREAD_TABLE_SIZE];
+
+// The fast path reads page table entries, and sets bits in them, while
+// the OS may be changing them from another processor.
+// Translation cache entries are published by their context pointer, which
+// another processor may clear at any time.
+#ifdef  WINDOWS
+#define AtomicLoadPTE(Entry)        (*(volatile UINT16 *)(Entry))
+#define AtomicOrPTE(Entry, Bits)    InterlockedOr16((SHORT *)(Entry), (SHORT)(Bits))
+#define AtomicLoadContext(Slot)     (*(Z502CONTEXT * volatile *)(Slot))
+#define AtomicStoreContext(Slot, C) InterlockedExchangePointer((PVOID *)(Slot), (PVOID)(C))
+#define AtomicAddTime(Time, Delta)  ((UINT32)InterlockedExchangeAdd((LONG volatile *)(Time), (LONG)(Delta)) + (UINT32)(Delta))
+#define AtomicRaiseTime(Time, Old, New) \
+    (InterlockedCompareExchange((LONG volatile *)(Time), (LONG)(New), (LONG)(Old)) == (LONG)(Old))
+#else
+#define AtomicLoadPTE(Entry)        __atomic_load_n((Entry), __ATOMIC_ACQUIRE)
+#define AtomicOrPTE(Entry, Bits)    __atomic_fetch_or((Entry), (UINT16)(Bits), __ATOMIC_SEQ_CST)
+#define AtomicLoadContext(Slot)     __atomic_load_n((Slot), __ATOMIC_ACQUIRE)
+#define AtomicStoreContext(Slot, C) __atomic_store_n((Slot), (C), __ATOMIC_RELEASE)
+#define AtomicAddTime(Time, Delta)  __atomic_add_fetch((Time), (UINT32)(Delta), __ATOMIC_SEQ_CST)
+#define AtomicRaiseTime(Time, Old, New) \
+    __atomic_compare_exchange_n((Time), &(Old), (UINT32)(New), FALSE, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)
+#endif
+#define MemoryStripe(Frame)         MemoryStripeLock[(Frame) % MEMORY_LOCK_STRIPES]
+
+// The simulated TLBs, one per processor, and the clock used for LRU
+TLB_ENTRY Tlb[MAX_THREAD_TABLE_SIZE][TLB_ENTRIES];
+INT32 TlbClock = 0;
+
 #ifdef   WINDOWS
 HANDLE LocalEvent[100];
 #endif
@@ -245,48 +293,62 @@ int            NextMutexToAllocate = 0;
 #endif
 
 /*****************************************************************
- MemoryCommon
+ TranslatePage
  
- This code simulates a memory access.  Actions include:
+ This code translates one virtual page for a memory access.
+ The caller holds the HardwareLock.  Actions include:
  o Take a page fault if any of the following occur;
  + Illegal virtual address,
  + Page table doesn't exist,
  + Address is larger than page table,
  + Page table entry exists, but page is invalid.
- o The page exists in physical memory, so get the physical address.
- Be careful since it may wrap across frame boundaries.
- o Copy data to/from caller's location.
+ o The page exists in physical memory, so return its frame.
  o Set referenced/modified bit in page table.
- o Advance time and see if an interrupt has occurred.
  *****************************************************************/
 
-void MemoryCommon(INT32 VirtualAddress, char *data_ptr, BOOL read_or_write) {
-    INT16 VirtualPageNumber;
+INT32 TranslatePage(INT16 VirtualPageNumber, INT32 PageOffset,
+                    BOOL read_or_write) {
+    int ProcessorID;
+    Z502CONTEXT *Context;
+    UINT16 *PageTableEntry;
+    TLB_ENTRY *TlbEntry;
     INT32 PhysicalFrameNumber;
-    INT16 PhysicalAddress[4];
-    INT32 PageOffset;         // The offset of the address into the page
-    //INT16 index;
     INT32 PageTableBits;      // A memory reference sets bits in Page Table
     INT16 Invalidity;         // Describes what's wrong with the access
     BOOL  PageIsValid;
-    char Debug_Text[32];
-    
-    strcpy(Debug_Text, "MemoryCommon");
-    GetLock(HardwareLock, "MemoryCommon#1");
-    // Addresses above a certain value are assumed to be accessing
-    // hardware and so we then go to MemoryMappedIO to handle them.
-    if (VirtualAddress >= Z502MEM_MAPPED_MIN) {
-        MemoryMappedIO(VirtualAddress, (MEMORY_MAPPED_IO *) data_ptr,
-                       read_or_write);
-        ReleaseLock(HardwareLock, "MemoryCommon#2");
-        return;
-    }
-    VirtualPageNumber = (INT16) (
-                                 (VirtualAddress >= 0) ? VirtualAddress / PGSIZE : -1);
-    PageOffset = VirtualAddress % PGSIZE;
     
     PageIsValid =FALSE;
     
+    //  A hit in the translation cache means the page already passed
+    //  tests 1 - 4 below; only alignment and the valid bit can change.
+    ProcessorID = GetProcessorID();
+    Context = ThreadTable[ProcessorID].Context;
+    PageTableEntry = LookupTranslation(ProcessorID, Context, VirtualPageNumber);
+    
+    //  A TLB hit is used without looking at the page table at all.
+    //  The first write through an entry goes to the page table, though,
+    //  so that the modified bit gets set there.
+    TlbEntry = NULL;
+    if (DO_TLB && (PageOffset % 4) == 0) {
+        TlbEntry = TlbLookup(TlbProcessor(ProcessorID), Context,
+                             VirtualPageNumber);
+        if (TlbEntry != NULL && read_or_write == SYSNUM_MEM_WRITE
+            && ((TlbEntry->PageTableEntry & PTBL_MODIFIED_BIT) == 0
+                || (TlbEntry->PageTableEntry & PTBL_READ_ONLY_BIT) != 0))
+            TlbEntry = NULL;
+        if (TlbEntry != NULL) {
+            PageIsValid = TRUE;
+            HardwareStats.TlbHits++;
+        }
+    }
+    if (PageIsValid == FALSE && PageTableEntry != NULL && (PageOffset % 4) == 0
+        && (*PageTableEntry & PTBL_VALID_BIT) != 0
+        && (read_or_write != SYSNUM_MEM_WRITE
+            || (*PageTableEntry & PTBL_READ_ONLY_BIT) == 0)) {
+        PageIsValid = TRUE;
+        HardwareStats.TranslationCacheHits++;
+    }
+    
     //  Loop until the virtual page passes all the tests
     //  We check:
     //  1.  The Virtual Page Number is legal
@@ -294,7 +356,10 @@ void MemoryCommon(INT32 VirtualAddress, char *data_ptr, BOOL read_or_write) {
     //  3.  That the memory address is aligned correctly.
     //      We are always reading or writing 4-byte segments
     //      so everything should be aligned mod-4.
-    //  4.  The valid bit is set for the page table entry.
+    //  4.  The page directory has a leaf table covering this page.
+    //      Leaf tables are allocated by the OS as pages are first
+    //      touched, so this is a normal reason to fault.
+    //  5.  The valid bit is set for the page table entry.
     //      The first time we test a page, this bit will not
     //      be set.  It's the job of the fault handler and the
     //      OS to set this bit.
@@ -310,31 +375,111 @@ void MemoryCommon(INT32 VirtualAddress, char *data_ptr, BOOL read_or_write) {
         if ( (PageOffset % 4 ) != 0 )
             Invalidity = 4;
         if ((Invalidity == 0)
-            && (GetPageTableAddress()[(UINT16) VirtualPageNumber]
+            && GetPageTableEntry(VirtualPageNumber) == NULL)
+            Invalidity = 6;
+        if ((Invalidity == 0)
+            && (*GetPageTableEntry(VirtualPageNumber)
                 & PTBL_VALID_BIT) == 0)
             Invalidity = 5;
+        if ((Invalidity == 0) && read_or_write == SYSNUM_MEM_WRITE
+            && (*GetPageTableEntry(VirtualPageNumber)
+                & PTBL_READ_ONLY_BIT) != 0)
+            Invalidity = 7;
         
         DoMemoryDebug(Invalidity, VirtualPageNumber);
         // The address or the page table is not correct.  Go take a fault
         if (Invalidity > 0) {
-            if ((GetCurrentContext() != NULL)
-                && ((GetCurrentContext()->StructureID)
+            if ((Context != NULL)
+                && ((Context->StructureID)
                     != CONTEXT_STRUCTURE_ID )) {
                     aprintf( "The address of the current context is invalid in MemoryCommon\n");
                     aprintf("Something in the OS has destroyed this location.\n");
                     HardwareInternalPanic(ERR_OS502_GENERATED_BUG);
                 }
-            GetCurrentContext()->FaultInProgress = TRUE;
+            Context->FaultInProgress = TRUE;
             // The fault handler will do it's own locking - 11/13/11
             ReleaseLock(HardwareLock, "MemoryCommon#3");
             HardwareFault(INVALID_MEMORY, VirtualPageNumber);
             // Regain the lock to protect the memory check - 11/13/11
             GetLock(HardwareLock, "MemoryCommon#4");
-        } else
+        } else {
             PageIsValid = TRUE;
+            PageTableEntry = GetPageTableEntry(VirtualPageNumber);
+            InsertTranslation(ProcessorID, Context, VirtualPageNumber,
+                              PageTableEntry);
+            HardwareStats.TranslationCacheMisses++;
+        }
     } /* END of while         */
-    PhysicalFrameNumber = GetPageTableAddress()[VirtualPageNumber] & PTBL_PHYS_PG_NO;
-    PhysicalAddress[0] = (INT16) (PhysicalFrameNumber * (INT32) PGSIZE + PageOffset);
+    if (TlbEntry != NULL)
+        PhysicalFrameNumber = TlbEntry->PageTableEntry & PTBL_PHYS_PG_NO;
+    else
+        PhysicalFrameNumber = *PageTableEntry & PTBL_PHYS_PG_NO;
+    if (PhysicalFrameNumber < 0 || PhysicalFrameNumber > NUMBER_PHYSICAL_PAGES - 1) {
+        aprintf("The physical address is invalid in MemoryCommon\n");
+        aprintf("Physical page = %d, Virtual Page = %d\n", PhysicalFrameNumber,
+                VirtualPageNumber);
+        HardwareInternalPanic(ERR_OS502_GENERATED_BUG);
+    }
+    if (Context != NULL
+        && Context->StructureID != CONTEXT_STRUCTURE_ID) {
+        aprintf("The address of the context is invalid in MemoryCommon\n");
+        aprintf("Something in the OS has destroyed this location.\n");
+        HardwareInternalPanic(ERR_OS502_GENERATED_BUG);
+    }
+    Context->FaultInProgress = FALSE;
+    
+    PageTableBits = PTBL_REFERENCED_BIT;
+    if (read_or_write == SYSNUM_MEM_WRITE)
+        PageTableBits = PTBL_REFERENCED_BIT | PTBL_MODIFIED_BIT;
+    if (TlbEntry == NULL) {
+        AtomicOrPTE(PageTableEntry, PageTableBits);
+        if (DO_TLB) {
+            HardwareStats.TlbMisses++;
+            TlbFill(TlbProcessor(ProcessorID), Context, VirtualPageNumber,
+                    *PageTableEntry);
+            ChargeTimeAndCheckEvents(COST_OF_TLB_MISS);
+        }
+    }
+    return PhysicalFrameNumber;
+}                      // End of TranslatePage
+
+/*****************************************************************
+ MemoryCommon
+ 
+ This code simulates a memory access.  Actions include:
+ o Translate the page, taking a page fault if need be.
+ o Copy data to/from caller's location.
+ o Advance time and see if an interrupt has occurred.
+ *****************************************************************/
+
+void MemoryCommon(INT32 VirtualAddress, char *data_ptr, BOOL read_or_write) {
+    INT16 VirtualPageNumber;
+    INT32 PhysicalFrameNumber;
+    INT32 PhysicalAddress[4];
+    INT32 PageOffset;         // The offset of the address into the page
+    //INT16 index;
+    char Debug_Text[32];
+    
+    strcpy(Debug_Text, "MemoryCommon");
+    if (VirtualAddress >= 0 && VirtualAddress < Z502MEM_MAPPED_MIN
+        && MemoryFastPath(VirtualAddress, data_ptr, read_or_write))
+        return;
+    GetLock(HardwareLock, "MemoryCommon#1");
+    // Addresses above a certain value are assumed to be accessing
+    // hardware and so we then go to MemoryMappedIO to handle them.
+    if (VirtualAddress >= Z502MEM_MAPPED_MIN) {
+        MemoryMappedIO(VirtualAddress, (MEMORY_MAPPED_IO *) data_ptr,
+                       read_or_write);
+        ReleaseLock(HardwareLock, "MemoryCommon#2");
+        return;
+    }
+    VirtualPageNumber = (INT16) (
+                                 (VirtualAddress >= 0) ? VirtualAddress / PGSIZE : -1);
+    PageOffset = VirtualAddress % PGSIZE;
+    
+    PhysicalFrameNumber = TranslatePage(VirtualPageNumber, PageOffset,
+                                        read_or_write);
+    PhysicalAddress[0] = PhysicalFrameNumber * (INT32) PGSIZE + PageOffset;
     PhysicalAddress[1] = PhysicalAddress[0] + 1; /* first guess */
     PhysicalAddress[2] = PhysicalAddress[0] + 2; /* first guess */
     PhysicalAddress[3] = PhysicalAddress[0] + 3; /* first guess */
@@ -374,45 +519,139 @@ void MemoryCommon(INT32 VirtualAddress, char *data_ptr, BOOL read_or_write) {
      + PageOffset + (INT32) index);
      } // End of if page
      ***************************************/
-    if (PhysicalFrameNumber < 0 || PhysicalFrameNumber > NUMBER_PHYSICAL_PAGES - 1) {
-        aprintf("The physical address is invalid in MemoryCommon\n");
-        aprintf("Physical page = %d, Virtual Page = %d\n", PhysicalFrameNumber,
-                VirtualPageNumber);
-        HardwareInternalPanic(ERR_OS502_GENERATED_BUG);
-    }
-    if (GetCurrentContext() != NULL
-        && GetCurrentContext()->StructureID != CONTEXT_STRUCTURE_ID) {
-        aprintf("The address of the context is invalid in MemoryCommon\n");
-        aprintf("Something in the OS has destroyed this location.\n");
-        HardwareInternalPanic(ERR_OS502_GENERATED_BUG);
-    }
-    GetCurrentContext()->FaultInProgress = FALSE;
     
-    if (read_or_write == SYSNUM_MEM_READ) {
-        data_ptr[0] = MEMORY[PhysicalAddress[0]];
-        data_ptr[1] = MEMORY[PhysicalAddress[1]];
-        data_ptr[2] = MEMORY[PhysicalAddress[2]];
-        data_ptr[3] = MEMORY[PhysicalAddress[3]];
-        PageTableBits = PTBL_REFERENCED_BIT;
-    }
-    
-    if (read_or_write == SYSNUM_MEM_WRITE) {
-        MEMORY[PhysicalAddress[0]] = data_ptr[0];
-        MEMORY[PhysicalAddress[1]] = data_ptr[1];
-        MEMORY[PhysicalAddress[2]] = data_ptr[2];
-        MEMORY[PhysicalAddress[3]] = data_ptr[3];
-        PageTableBits = PTBL_REFERENCED_BIT | PTBL_MODIFIED_BIT;
-    }
+    // Accesses are aligned, so the four bytes are contiguous in MEMORY
+    GetLock(MemoryStripe(PhysicalFrameNumber), "MemoryCommon#6");
+    if (read_or_write == SYSNUM_MEM_READ)
+        memcpy(data_ptr, &MEMORY[PhysicalAddress[0]], 4);
     
-    GetPageTableAddress()[VirtualPageNumber] |= PageTableBits;
-    if (PageOffset > PGSIZE - 4)
-        GetPageTableAddress()[VirtualPageNumber + 1] |= PageTableBits;
+    if (read_or_write == SYSNUM_MEM_WRITE)
+        memcpy(&MEMORY[PhysicalAddress[0]], data_ptr, 4);
+    ReleaseLock(MemoryStripe(PhysicalFrameNumber), "MemoryCommon#7");
     
     ChargeTimeAndCheckEvents(COST_OF_MEMORY_ACCESS);
     
     ReleaseLock(HardwareLock, "MemoryCommon#5");
 }                      // End of MemoryCommon
 
+/*****************************************************************
+ MemoryFastPath
+ 
+ Most accesses are to a page that is valid and whose page table
+ entry is already in this processor's translation cache.  Those
+ don't need the HardwareLock at all:
+ o Check the cached entry is valid, using an atomic load.
+ o Lock just the stripe covering the frame, and make sure the OS
+   hasn't moved the page while we were getting the lock.
+ o Copy the data and set the referenced/modified bits atomically.
+ Returns FALSE, having done nothing, whenever the access might fault
+ or needs the TLB; MemoryCommon then takes the slow path.
+ *****************************************************************/
+
+BOOL MemoryFastPath(INT32 VirtualAddress, char *data_ptr,
+                    BOOL read_or_write) {
+    INT16 VirtualPageNumber;
+    INT32 PageOffset;
+    INT32 PhysicalFrameNumber;
+    INT32 ProcessorID;
+    Z502CONTEXT *Context;
+    UINT16 *PageTableEntry;
+    UINT16 Entry;
+    UINT16 PageTableBits;
+    
+    VirtualPageNumber = (INT16) (VirtualAddress / PGSIZE);
+    PageOffset = VirtualAddress % PGSIZE;
+    if (DO_TLB || (PageOffset % 4) != 0
+        || VirtualPageNumber >= NUMBER_VIRTUAL_PAGES)
+        return FALSE;
+    ProcessorID = GetProcessorID();
+    Context = ThreadTable[ProcessorID].Context;
+    if (Context == NULL || Context->StructureID != CONTEXT_STRUCTURE_ID)
+        return FALSE;
+    PageTableEntry = LookupTranslation(ProcessorID, Context, VirtualPageNumber);
+    if (PageTableEntry == NULL)
+        return FALSE;
+    Entry = AtomicLoadPTE(PageTableEntry);
+    if ((Entry & PTBL_VALID_BIT) == 0)
+        return FALSE;
+    if (read_or_write == SYSNUM_MEM_WRITE && (Entry & PTBL_READ_ONLY_BIT) != 0)
+        return FALSE;
+    PhysicalFrameNumber = Entry & PTBL_PHYS_PG_NO;
+    if (PhysicalFrameNumber >= NUMBER_PHYSICAL_PAGES)
+        return FALSE;
+    
+    GetLock(MemoryStripe(PhysicalFrameNumber), "MemoryFastPath#1");
+    if ((AtomicLoadPTE(PageTableEntry)
+         & (PTBL_VALID_BIT | PTBL_READ_ONLY_BIT | PTBL_PHYS_PG_NO))
+        != (Entry & (PTBL_VALID_BIT | PTBL_READ_ONLY_BIT | PTBL_PHYS_PG_NO))) {
+        ReleaseLock(MemoryStripe(PhysicalFrameNumber), "MemoryFastPath#2");
+        return FALSE;
+    }
+    if (read_or_write == SYSNUM_MEM_READ)
+        memcpy(data_ptr, &MEMORY[PhysicalFrameNumber * PGSIZE + PageOffset], 4);
+    if (read_or_write == SYSNUM_MEM_WRITE)
+        memcpy(&MEMORY[PhysicalFrameNumber * PGSIZE + PageOffset], data_ptr, 4);
+    PageTableBits = PTBL_REFERENCED_BIT;
+    if (read_or_write == SYSNUM_MEM_WRITE)
+        PageTableBits = PTBL_REFERENCED_BIT | PTBL_MODIFIED_BIT;
+    AtomicOrPTE(PageTableEntry, PageTableBits);
+    ReleaseLock(MemoryStripe(PhysicalFrameNumber), "MemoryFastPath#3");
+    
+    FastPathAccesses[ProcessorID]++;
+    ChargeTimeAndCheckEvents(COST_OF_MEMORY_ACCESS);
+    return TRUE;
+}                      // End of MemoryFastPath
+
+/*****************************************************************
+ MemoryBlockCommon
+ 
+ Moves Length bytes between the caller's buffer and virtual memory,
+ starting at a 4-byte aligned address and crossing page boundaries
+ as needed.  Each page is translated once, faulting it in if it
+ isn't valid, and gets its referenced/modified bits set.  The whole
+ transfer is charged COST_OF_MEMORY_BLOCK plus one memory access per
+ page, rather than one memory access per word.
+ *****************************************************************/
+
+void MemoryBlockCommon(INT32 VirtualAddress, char *data_ptr, INT32 Length,
+                       BOOL read_or_write) {
+    INT16 VirtualPageNumber;
+    INT32 PhysicalFrameNumber;
+    INT32 PageOffset;
+    INT32 Chunk;
+    INT32 PagesTouched = 0;
+    
+    if (Length <= 0)
+        return;
+    GetLock(HardwareLock, "MemoryBlockCommon#1");
+    while (Length > 0) {
+        VirtualPageNumber = (INT16) (
+                                     (VirtualAddress >= 0) ? VirtualAddress / PGSIZE : -1);
+        PageOffset = VirtualAddress % PGSIZE;
+        Chunk = PGSIZE - PageOffset;
+        if (Chunk > Length)
+            Chunk = Length;
+        PhysicalFrameNumber = TranslatePage(VirtualPageNumber, PageOffset,
+                                            read_or_write);
+        GetLock(MemoryStripe(PhysicalFrameNumber), "MemoryBlockCommon#3");
+        if (read_or_write == SYSNUM_MEM_READ)
+            memcpy(data_ptr,
+                   &MEMORY[PhysicalFrameNumber * PGSIZE + PageOffset], Chunk);
+        else
+            memcpy(&MEMORY[PhysicalFrameNumber * PGSIZE + PageOffset],
+                   data_ptr, Chunk);
+        ReleaseLock(MemoryStripe(PhysicalFrameNumber), "MemoryBlockCommon#4");
+        VirtualAddress += Chunk;
+        data_ptr += Chunk;
+        Length -= Chunk;
+        PagesTouched++;
+    }
+    HardwareStats.BlockTransfers++;
+    ChargeTimeAndCheckEvents(COST_OF_MEMORY_BLOCK
+                             + PagesTouched * COST_OF_MEMORY_ACCESS);
+    ReleaseLock(HardwareLock, "MemoryBlockCommon#2");
+}                      // End of MemoryBlockCommon
+
 /*****************************************************************
  DoMemoryDebug
  
@@ -453,7 +692,17 @@ void DoMemoryDebug(INT16 Invalidity, INT16 vpn) {
         aprintf("\t\tYou must aim this virtual page at a physical frame\n");
         aprintf("\t\tand mark this page table slot as valid.\n");
     }
-    if ( Invalidity > 5 )
+    if (Invalidity == 6) {
+        aprintf("There is no leaf page table covering virtual page %d\n", vpn);
+        aprintf("\t\tThe OS must allocate one and put it in the\n");
+        aprintf("\t\tpage directory before the page can be used.\n");
+    }
+    if (Invalidity == 7) {
+        aprintf("You wrote to virtual page %d, which is marked\n", vpn);
+        aprintf("\t\tread only.  The OS must give the page a frame of\n");
+        aprintf("\t\tits own, or clear the bit, before it can be written.\n");
+    }
+    if ( Invalidity > 7 )
         HardwareInternalPanic(ERR_Z502_INTERNAL_BUG);
 }                        // End of DoMemoryDebug
 
@@ -474,6 +723,23 @@ void Z502MemoryWrite(INT32 VirtualAddress, INT32 *data_ptr) {
     MemoryCommon(VirtualAddress, (char *) data_ptr, (BOOL) SYSNUM_MEM_WRITE);
 }                  // End  Z502MemoryWrite
 
+/*****************************************************************
+ Z502MemoryReadBlock   and   Z502MemoryWriteBlock
+ 
+ Move a block of Length bytes with a single call
+ 
+ *****************************************************************/
+
+void Z502MemoryReadBlock(INT32 VirtualAddress, char *data_ptr, INT32 Length) {
+    
+    MemoryBlockCommon(VirtualAddress, data_ptr, Length, (BOOL) SYSNUM_MEM_READ);
+}                  // End  Z502MemoryReadBlock
+
+void Z502MemoryWriteBlock(INT32 VirtualAddress, char *data_ptr, INT32 Length) {
+    
+    MemoryBlockCommon(VirtualAddress, data_ptr, Length, (BOOL) SYSNUM_MEM_WRITE);
+}                  // End  Z502MemoryWriteBlock
+
 /*************************************************************************
  Z502MemoryReadModify
  
@@ -719,7 +985,7 @@ void MemoryMappedIO(INT32 address, MEMORY_MAPPED_IO *mmio, BOOL ReadOrWrite) {
             }  // End of Mode === StartContext
             
             if (mmio->Mode == Z502InitializeContext) {
-                MakeContext(&LongTemporary, mmio->Field2, (UINT16 *) mmio->Field3,
+                MakeContext(&LongTemporary, mmio->Field2, (UINT16 **) mmio->Field3,
                             KERNEL_MODE);
                 mmio->Field1 = LongTemporary;    // Context pointer
                 mmio->Field4 = ERR_SUCCESS;      // Error code
@@ -749,6 +1015,31 @@ void MemoryMappedIO(INT32 address, MEMORY_MAPPED_IO *mmio, BOOL ReadOrWrite) {
             break;
         }   // End of case Context
             
+            // The TLB.  Status reports its size (0 == there is no TLB).
+            // A flush names a context in Field1 (0 == every context) and,
+            // for a single entry, the virtual page in Field2.  Flushes
+            // reach the TLB of every processor.
+        case Z502TLB: {
+            mmio->Field4 = ERR_SUCCESS;
+            if (mmio->Mode == Z502Status) {
+                mmio->Field1 = DO_TLB ? TLB_ENTRIES : 0;
+                mmio->Field2 = TLB_WAYS;
+                break;
+            }
+            if (mmio->Mode == Z502FlushTLBEntry) {
+                TlbFlush(GetProcessorID(), (Z502CONTEXT *) mmio->Field1,
+                         (INT16) mmio->Field2, FALSE);
+                break;
+            }
+            if (mmio->Mode == Z502FlushTLB) {
+                TlbFlush(GetProcessorID(), (Z502CONTEXT *) mmio->Field1,
+                         0, TRUE);
+                break;
+            }
+            mmio->Field4 = ERR_BAD_PARAM;
+            break;
+        }     // End of case Z502TLB
+            
             // Implement a multiprocessor simulation
         case Z502Processor: {
             if (mmio->Mode == Z502SetProcessorNumber) {
@@ -796,7 +1087,7 @@ void MemoryMappedIO(INT32 address, MEMORY_MAPPED_IO *mmio, BOOL ReadOrWrite) {
 
 void PhysicalMemoryCommon(INT32 PhysicalPageNumber, char *data_ptr,
                           BOOL read_or_write) {
-    INT16 PhysicalPageAddress;
+    INT32 PhysicalPageAddress;
     INT16 index;
     char Debug_Text[32];
     
@@ -810,13 +1101,15 @@ void PhysicalMemoryCommon(INT32 PhysicalPageNumber, char *data_ptr,
     }
     // If the user has asked for an illegal physical page, take a fault
     // then return with no modification to the user's buffer.
-    if (PhysicalPageNumber < 0 || PhysicalPageNumber > NUMBER_PHYSICAL_PAGES) {
+    if (PhysicalPageNumber < 0 || PhysicalPageNumber >= NUMBER_PHYSICAL_PAGES) {
         ReleaseLock(HardwareLock, Debug_Text);
         HardwareFault(INVALID_PHYSICAL_MEMORY, PhysicalPageNumber);
         return;
     }
     PhysicalPageAddress = PGSIZE * PhysicalPageNumber;
     
+    // Keep out fast path accesses to this frame while we copy it
+    GetLock(MemoryStripe(PhysicalPageNumber), Debug_Text);
     if (read_or_write == SYSNUM_MEM_READ) {
         for (index = 0; index < PGSIZE ; index++)
             data_ptr[index] = MEMORY[PhysicalPageAddress + index];
@@ -826,6 +1119,7 @@ void PhysicalMemoryCommon(INT32 PhysicalPageNumber, char *data_ptr,
         for (index = 0; index < PGSIZE ; index++)
             MEMORY[PhysicalPageAddress + index] = data_ptr[index];
     }
+    ReleaseLock(MemoryStripe(PhysicalPageNumber), Debug_Text);
     
     ChargeTimeAndCheckEvents(COST_OF_MEMORY_ACCESS);
     ReleaseLock(HardwareLock, Debug_Text);
@@ -1041,7 +1335,7 @@ void HardwareCheckDisk(int DiskID) {
     INT32 local_error;
     char *BufferPointer;
     unsigned char LocalBuffer[PGSIZE ];
-    char OutputString[120];
+    char OutputString[6 + 3 * PGSIZE + 1];
     char TempString[16];
     
     Output = fopen("CheckDiskData", "w");
@@ -1248,9 +1542,13 @@ void IdleSimulation(void) {
         aprintf("   the event-check and Z502Idle\n");
         HardwareInternalPanic(ERR_OS502_GENERATED_BUG);
     }
-    if ((time_of_next_event > 0)
-        && (CurrentSimulationTime < (UINT32) time_of_next_event))
-        CurrentSimulationTime = time_of_next_event;
+    // Fast-path accesses may be charging time concurrently
+    if (time_of_next_event > 0) {
+        UINT32 Now = CurrentSimulationTime;
+        while (Now < (UINT32) time_of_next_event
+               && !AtomicRaiseTime(&CurrentSimulationTime, Now, time_of_next_event))
+            Now = CurrentSimulationTime;
+    }
     ReleaseLock(HardwareLock, "Z502Simulation");
     SignalCondition(InterruptCondition, "Z502Simulation");
 }                    // End of Z502Idle
@@ -1273,7 +1571,7 @@ void IdleSimulation(void) {
  *****************************************************************/
 
 void MakeContext(long *ReturningContextPointer, long starting_address,
-                 UINT16* PageTable, BOOL user_or_kernel) {
+                 UINT16** PageTable, BOOL user_or_kernel) {
     Z502CONTEXT *our_ptr;
     int Temporary;
     
@@ -1295,16 +1593,17 @@ void MakeContext(long *ReturningContextPointer, long starting_address,
     }
     
     // Our goal here is to save the OS developer some pain later on.
-    // We assume that the page table handed to us is valid, and that it
-    // has a length of VIRTUAL_MEM_PAGES.  Check that we can touch this
+    // We assume that the page directory handed to us is valid, and that
+    // it has PTBL_DIRECTORY_ENTRIES slots.  Check that we can touch this
     // much memory.  If not, then we will crash here rather than later.
-    Temporary = PageTable[0];
-    PageTable[NUMBER_VIRTUAL_PAGES - 1] = Temporary;
+    Temporary = (PageTable[0] != NULL);
+    Temporary += (PageTable[PTBL_DIRECTORY_ENTRIES - 1] != NULL);
     // Well, if we get here, then the OS correctly allocated memory.
     
     our_ptr->StructureID = CONTEXT_STRUCTURE_ID;
     our_ptr->CodeEntry = (void *) starting_address;
     our_ptr->PageTablePointer = (void *) PageTable;
+    InvalidateTranslations(our_ptr);
     our_ptr->ContextStartCount = 0;
     // our_ptr->program_mode = user_or_kernel;    BUGFIX  4.10 - July 2014
     our_ptr->ProgramMode = KERNEL_MODE;  // Always start process in Kernel Mode
@@ -1529,8 +1828,10 @@ void SwitchContext(void **IncomingContextPointer, BOOL DoStartSuspend) {
  *       associated with caller.
  * SetCurrentContext()  When a processor is started, place the
  *       context that's being run in a place we can find it.
- * GetPageTableAddress() - Function returns address of Page Table
- *       in use by the caller.
+ * GetPageTableAddress() - Function returns address of the Page
+ *       Directory in use by the caller.
+ * GetPageTableEntry() - Walks that directory to the entry for a
+ *       virtual page, or NULL if no leaf table covers it.
  ****************************************************************/
 //
 // Finds which processor is being run for the process that makes this call
@@ -1570,13 +1871,146 @@ void SetCurrentContext(Z502CONTEXT *Address) {
 
 // Return the Page Table of the  process that's
 //   currently running on the processor of the caller
-UINT16 *GetPageTableAddress() {
+UINT16 **GetPageTableAddress() {
     return ThreadTable[GetProcessorID()].Context->PageTablePointer;
 }    // End of  GetPageTableAddress()
 
+// The translation cache is direct mapped on the virtual page number.
+//   A hit needs both the context and the page to match.  The context is
+//   read again after the entry, so an entry invalidated part way through
+//   the lookup is a miss rather than a stale page table entry.
+UINT16 *LookupTranslation(int ProcessorID, Z502CONTEXT *Context,
+                          INT16 VirtualPageNumber) {
+    TRANSLATION_CACHE_ENTRY *Entry;
+    UINT16 *PageTableEntry;
+    if (VirtualPageNumber < 0)
+        return NULL;
+    Entry = &TranslationCache[ProcessorID]
+                [VirtualPageNumber % TRANSLATION_CACHE_SIZE];
+    if (AtomicLoadContext(&Entry->Context) != Context
+        || Entry->VirtualPageNumber != VirtualPageNumber)
+        return NULL;
+    PageTableEntry = Entry->PageTableEntry;
+    if (AtomicLoadContext(&Entry->Context) != Context)
+        return NULL;
+    return PageTableEntry;
+}    // End of  LookupTranslation()
+
+// Only the owning processor fills its entries.  The context is written
+//   last, so no other processor can see it with the old page or entry.
+void InsertTranslation(int ProcessorID, Z502CONTEXT *Context,
+                       INT16 VirtualPageNumber, UINT16 *PageTableEntry) {
+    TRANSLATION_CACHE_ENTRY *Entry;
+    Entry = &TranslationCache[ProcessorID]
+                [VirtualPageNumber % TRANSLATION_CACHE_SIZE];
+    AtomicStoreContext(&Entry->Context, NULL);
+    Entry->VirtualPageNumber = VirtualPageNumber;
+    Entry->PageTableEntry = PageTableEntry;
+    AtomicStoreContext(&Entry->Context, Context);
+}    // End of  InsertTranslation()
+
+// Forget everything cached for a context, on every processor.  Needed
+//   whenever the context gets a different page directory.
+void InvalidateTranslations(Z502CONTEXT *Context) {
+    int i, j;
+    for (i = 0; i < MAX_THREAD_TABLE_SIZE; i++)
+        for (j = 0; j < TRANSLATION_CACHE_SIZE; j++)
+            if (AtomicLoadContext(&TranslationCache[i][j].Context) == Context)
+                AtomicStoreContext(&TranslationCache[i][j].Context, NULL);
+}    // End of  InvalidateTranslations()
+
+// In uniprocessor mode every process runs on the one processor and so
+//   shares its TLB; in multiprocessor mode each processor has its own.
+int TlbProcessor(int ProcessorID) {
+    if (Z502_CURRENT_NUMBER_OF_PROCESSORS > 1)
+        return ProcessorID;
+    return 0;
+}    // End of  TlbProcessor()
+
+TLB_ENTRY *TlbLookup(int Processor, Z502CONTEXT *Context,
+                     INT16 VirtualPageNumber) {
+    int Set, i;
+    TLB_ENTRY *Entry;
+    if (VirtualPageNumber < 0)
+        return NULL;
+    Set = VirtualPageNumber % (TLB_ENTRIES / TLB_WAYS);
+    for (i = 0; i < TLB_WAYS; i++) {
+        Entry = &Tlb[Processor][Set * TLB_WAYS + i];
+        if (Entry->Context == Context
+            && Entry->VirtualPageNumber == VirtualPageNumber) {
+            Entry->LastUsed = ++TlbClock;
+            return Entry;
+        }
+    }
+    return NULL;
+}    // End of  TlbLookup()
+
+// Load an entry into its set, replacing the least recently used one
+void TlbFill(int Processor, Z502CONTEXT *Context, INT16 VirtualPageNumber,
+             UINT16 PageTableEntry) {
+    int Set, i;
+    TLB_ENTRY *Victim;
+    Set = VirtualPageNumber % (TLB_ENTRIES / TLB_WAYS);
+    Victim = &Tlb[Processor][Set * TLB_WAYS];
+    for (i = 0; i < TLB_WAYS; i++) {
+        TLB_ENTRY *Entry = &Tlb[Processor][Set * TLB_WAYS + i];
+        if (Entry->Context == Context
+            && Entry->VirtualPageNumber == VirtualPageNumber) {
+            Victim = Entry;
+            break;
+        }
+        if (Entry->LastUsed < Victim->LastUsed)
+            Victim = Entry;
+    }
+    Victim->Context = Context;
+    Victim->VirtualPageNumber = VirtualPageNumber;
+    Victim->PageTableEntry = PageTableEntry;
+    Victim->LastUsed = ++TlbClock;
+}    // End of  TlbFill()
+
+// Flush matching entries from every processor's TLB.  Each other
+//   processor that had to drop something counts as a shootdown and
+//   charges the requester for the interprocessor interrupt.
+void TlbFlush(int RequestingProcessor, Z502CONTEXT *Context,
+              INT16 VirtualPageNumber, BOOL All) {
+    int Processor, i;
+    BOOL Flushed;
+    HardwareStats.TlbFlushes++;
+    for (Processor = 0; Processor < MAX_THREAD_TABLE_SIZE; Processor++) {
+        Flushed = FALSE;
+        for (i = 0; i < TLB_ENTRIES; i++) {
+            TLB_ENTRY *Entry = &Tlb[Processor][i];
+            if (Entry->Context == NULL)
+                continue;
+            if (Context != NULL && Entry->Context != Context)
+                continue;
+            if (All == FALSE && Entry->VirtualPageNumber != VirtualPageNumber)
+                continue;
+            Entry->Context = NULL;
+            Entry->LastUsed = 0;
+            Flushed = TRUE;
+        }
+        if (Flushed && Processor != TlbProcessor(RequestingProcessor)) {
+            HardwareStats.TlbShootdowns++;
+            ChargeTimeAndCheckEvents(COST_OF_TLB_SHOOTDOWN);
+        }
+    }
+}    // End of  TlbFlush()
+
+// Two level page walk: the directory holds one pointer per
+//   PTBL_LEAF_ENTRIES virtual pages, and the leaf holds the entries
+UINT16 *GetPageTableEntry(INT16 VirtualPageNumber) {
+    UINT16 *Leaf;
+    Leaf = GetPageTableAddress()[VirtualPageNumber / PTBL_LEAF_ENTRIES];
+    if (Leaf == NULL)
+        return NULL;
+    return &Leaf[VirtualPageNumber % PTBL_LEAF_ENTRIES];
+}    // End of  GetPageTableEntry()
+
 // Sets the Page Table of the  process that's
 //   currently running on the processor of the caller
-void SetPageTableAddress(UINT16 *address) {
+void SetPageTableAddress(UINT16 **address) {
+    InvalidateTranslations(ThreadTable[GetProcessorID()].Context);
     ThreadTable[GetProcessorID()].Context->PageTablePointer = address;
 }    // End of  SetPageTableAddress()
 
@@ -1637,17 +2071,24 @@ void SetMode(char *CallerLocation, INT16 mode)  {
 void ChargeTimeAndCheckEvents(INT32 time_to_charge) {
     static INT32  TimeOfNextSignalledEvent = 0;
     INT32 TimeOfNextEvent;;
+    UINT32 Now;
     
-    CurrentSimulationTime += time_to_charge;
-    HardwareStats.NumberChargeTimes++;
+    // Memory accesses on the fast path get here without the HardwareLock,
+    // so the clock is advanced atomically and only signalling is locked.
+    Now = AtomicAddTime(&CurrentSimulationTime, time_to_charge);
+    AtomicAddTime(&HardwareStats.NumberChargeTimes, 1);
     
     //printf( "Charge_Time... -- current time = %ld\n", CurrentSimulationTime );
     GetNextEventTime(&TimeOfNextEvent);
     if (( TimeOfNextEvent > 0 )
-        && ( TimeOfNextEvent <= (INT32) CurrentSimulationTime)
+        && ( TimeOfNextEvent <= (INT32) Now)
         && ( TimeOfNextSignalledEvent != TimeOfNextEvent )  ) {
-        SignalCondition(InterruptCondition, "Charge_Time");
-        TimeOfNextSignalledEvent = TimeOfNextEvent;;
+        GetLock(ClockLock, "Charge_Time#1");
+        if ( TimeOfNextSignalledEvent != TimeOfNextEvent ) {
+            SignalCondition(InterruptCondition, "Charge_Time");
+            TimeOfNextSignalledEvent = TimeOfNextEvent;
+        }
+        ReleaseLock(ClockLock, "Charge_Time#2");
     }
 }              // End of ChargeTimeAndCheckEvents
 
@@ -2254,6 +2695,22 @@ void PrintHardwareStats(void) {
             aprintf("Disk Utilization = %6.3f\n", util);
         }
     }
+    if (HardwareStats.TranslationCacheHits
+        + HardwareStats.TranslationCacheMisses > 0)
+        aprintf("Translation Cache Hits = %d: Misses = %d\n",
+                HardwareStats.TranslationCacheHits,
+                HardwareStats.TranslationCacheMisses);
+    temp = 0;
+    for (i = 0; i < MAX_THREAD_TABLE_SIZE; i++)
+        temp += FastPathAccesses[i];
+    if (temp > 0)
+        aprintf("Fast Path Accesses = %d\n", temp);
+    if (HardwareStats.BlockTransfers > 0)
+        aprintf("Block Transfers = %d\n", HardwareStats.BlockTransfers);
+    if (DO_TLB)
+        aprintf("TLB Hits = %d: Misses = %d: Flushes = %d: Shootdowns = %d\n",
+                HardwareStats.TlbHits, HardwareStats.TlbMisses,
+                HardwareStats.TlbFlushes, HardwareStats.TlbShootdowns);
     aprintf( "Total number of locks = %d    ", GetTotalNumberOfLocks());
     if (HardwareStats.NumberOfFaults > 0)
         aprintf("Faults = %5d:  ", HardwareStats.NumberOfFaults);
@@ -3601,6 +4058,40 @@ void GoToExit(int Value) {
     exit(Value);
 }             // End of GoToExit
 
+/*****************************************************************
+ Z502Configure()
+ 
+ Called by main() with the command line, before the hardware is
+ initialized.  Options that describe the hardware are taken out of
+ argv so the OS only sees its own arguments.
+ o -frames N    The number of physical pages of memory.
+ *****************************************************************/
+
+void Z502Configure(int *argc, char *argv[]) {
+    int In, Out;
+    INT32 Frames;
+    
+    if (Z502Initialized == TRUE) {
+        printf("Z502Configure must be called before the hardware is used\n");
+        GoToExit(1);
+    }
+    Out = 1;
+    for (In = 1; In < *argc; In++) {
+        if (strcmp(argv[In], "-frames") == 0 && In + 1 < *argc) {
+            Frames = atoi(argv[++In]);
+            if (Frames < 1 || Frames > MAX_NUMBER_PHYSICAL_PAGES) {
+                printf("-frames must be between 1 and %d\n",
+                       MAX_NUMBER_PHYSICAL_PAGES);
+                GoToExit(1);
+            }
+            Z502PhysicalPages = Frames;
+        } else
+            argv[Out++] = argv[In];
+    }
+    *argc = Out;
+    argv[Out] = NULL;
+}                                       // End of Z502Configure
+
 /*****************************************************************
  Z502Init()
  
@@ -3611,6 +4102,7 @@ void GoToExit(int Value) {
 
 void Z502Init() {
     INT16 i;
+    INT32 Byte;
     
     if (Z502Initialized == FALSE) {
         // Show that we've been in this code.
@@ -3633,13 +4125,22 @@ void Z502Init() {
         for (i = 0; i < MEMORY_INTERLOCK_SIZE; i++)
             InterlockRecord[i] = -1;
         
-        for (i = 0; i < sizeof(MEMORY); i++)
-            MEMORY[i] = i % 256;
+        MEMORY = (char *) malloc(NUMBER_PHYSICAL_PAGES * PGSIZE);
+        if (MEMORY == NULL) {
+            printf("Unable to allocate %d frames of physical memory\n",
+                   NUMBER_PHYSICAL_PAGES);
+            GoToExit(1);
+        }
+        for (Byte = 0; Byte < NUMBER_PHYSICAL_PAGES * PGSIZE; Byte++)
+            MEMORY[Byte] = Byte % 256;
         
         CreateLock(&EventLock, "Z502Init");
         CreateLock(&InterruptLock, "Z502Init");
         CreateLock(&HardwareLock, "Z502Init");
         CreateLock(&ThreadTableLock, "Z502Init");
+        CreateLock(&ClockLock, "Z502Init");
+        for (i = 0; i < MEMORY_LOCK_STRIPES; i++)
+            CreateLock(&MemoryStripeLock[i], "Z502Init");
         CreateCondition(&InterruptCondition);
         for (i = 0; i < MAX_NUMBER_OF_DISKS ; i++) {
             sector_queue[i].queue = NULL;
@@ -49,6 +49,13 @@
 #define         COST_OF_SOFTWARE_TRAP           5L
 #define         COST_OF_CPU_INSTRUCTION         1L
 #define         COST_OF_CALL                    2L
+#define         COST_OF_MEMORY_BLOCK            2L
+#define         COST_OF_TLB_MISS                3L
+#define         COST_OF_TLB_SHOOTDOWN           5L
+
+// The TLB (when DO_TLB is set) is TLB_WAYS way set associative
+#define         TLB_ENTRIES                     16
+#define         TLB_WAYS                        4
 
 #ifndef NULL
 #define         NULL                            0
@@ -103,6 +110,13 @@ typedef struct {
     INT32               NumberChargeTimes;
     INT32               NumberOfFaults;
     INT32               NumberOfSystemCalls;
+    INT32               TranslationCacheHits;
+    INT32               TranslationCacheMisses;
+    INT32               TlbHits;
+    INT32               TlbMisses;
+    INT32               TlbFlushes;
+    INT32               TlbShootdowns;
+    INT32               BlockTransfers;
 } HARDWARE_STATS;
 
 typedef struct {
@@ -116,7 +130,7 @@ typedef struct {
 typedef struct {
     unsigned char       StructureID;          // A unique ID so we know it's a CONTEXT
     void                *CodeEntry;           // Location where program starts
-    UINT16              *PageTablePointer;    // Address of page table for this process
+    UINT16              **PageTablePointer;   // Page directory for this process
     INT32               ContextStartCount;     // How many times this context has been started
     //   INT16               PC;                    // Current address of the process
     //   INT32               CallType;
@@ -125,6 +139,32 @@ typedef struct {
     BOOL                FaultInProgress;
 } Z502CONTEXT;
 
+// Each processor caches where the page table entries it has used live,
+// so that MemoryCommon doesn't have to walk the page directory again.
+// Only the location is cached, never the entry's contents, so anything
+// the OS writes into the page table is seen on the very next access.
+#define         TRANSLATION_CACHE_SIZE           64
+
+// Accesses that hit in the translation cache skip the HardwareLock and
+// take only the lock covering their frame.  Frames share these locks.
+#define         MEMORY_LOCK_STRIPES              16
+
+typedef struct {
+    Z502CONTEXT         *Context;             // NULL == slot is empty
+    INT16               VirtualPageNumber;
+    UINT16              *PageTableEntry;
+} TRANSLATION_CACHE_ENTRY;
+
+// Unlike the translation cache, a TLB entry holds a copy of the page
+// table entry, so it goes stale if the OS changes the entry without
+// flushing it.
+typedef struct {
+    Z502CONTEXT         *Context;             // NULL == slot is empty
+    INT16               VirtualPageNumber;
+    UINT16              PageTableEntry;
+    INT32               LastUsed;             // For LRU within a set
+} TLB_ENTRY;
+
 // We create a thread for every potential process a user might create.
 // This is the information we need for each thread.
 
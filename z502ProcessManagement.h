@@ -35,7 +35,7 @@ typedef struct Process_Control_Block{
     long currentContext;
     short DiskID;
     short SectorID;
-    long *Pagetable;
+    UINT16 **Pagetable;
     INT32 processID;
     INT32 processStatus;
     INT32 processPriority;
@@ -44,6 +44,15 @@ typedef struct Process_Control_Block{
     INT32 SourceID;
     Header *OpenDirectory;
     Inodeinfo *FileInode[MAX_NUMBER_INODES];
+    INT32 LastFaultPage;
+    INT32 FaultAroundWindow;
+    INT32 ResidentFrames;
+    INT32 FrameAllocation;
+    long PageFaults;
+    long FaultsInWindow;
+    long FaultWindowStart;
+    INT32 PageTableLeaves;
+    INT32 LoadState;
 }PCB;
 
 #define         DO_LOCK                         1
@@ -63,4 +72,104 @@ typedef struct Process_Control_Block{
 #define         Suspended  1
 #define         NotSuspended  0
 
+//  Load control: a deactivated process has had its pages written out and
+//  is not dispatched until the medium-term scheduler lets it back in.
+#define         LOAD_ACTIVE                     0
+#define         LOAD_DEACTIVATED                1
+#define         LOAD_DEACTIVATED_READY          2   // ... and would be on the ready queue
+
+//  Paging to the swap disk
+#define         SWAP_DISK                       0
+#define         SWAP_DISK_COUNT                 4       // Disks SWAP_DISK.. are striped
+#define         SWAP_FIRST_SECTOR             (BITMAP_LOCATION+BITMAP_SECTORS) // Past what FORMAT writes in place
+#define         SWAP_HASH_BUCKETS            1024
+#define         SWAP_HASH_MULTIPLIER         2654435761u
+#define         SWAP_ENTRY_CHUNK               64
+#define         FAULT_AROUND_MAX_PAGES          8
+//  Compressed swap cache in front of the swap disk; the header is the word mask
+#define         SWAP_CACHE_BYTES              512
+#define         SWAP_CACHE_HEADER_BYTES         ((PGSIZE/4+7)/8)
+#define         SWAP_CACHE_SPILL_BATCH          8
+//  Software PTE bit, outside PTBL_PHYS_PG_NO: the page has a swap copy
+#define         PTBL_SWAPPED_BIT                0x1000
+
+//  Page-fault-frequency frame allocation.  Rates are faults per PFF_WINDOW
+//  units of simulation time.
+#define         PFF_WINDOW                   2000
+#define         PFF_UPPER_THRESHOLD            12
+#define         PFF_LOWER_THRESHOLD             3
+#define         PFF_STEP                        4
+#define         PFF_MIN_FRAMES                  4
+
+//  The page-out daemon keeps the number of free frames between these
+#define         PAGEOUT_LOW_WATERMARK           4
+#define         PAGEOUT_HIGH_WATERMARK          8
+
+//  Load control: the system-wide fault rate is measured per window of
+//  simulation time.  Above the upper threshold the least favourable
+//  process is swapped out; below the lower one a swapped-out process
+//  comes back.  At least LOAD_CONTROL_MIN_ACTIVE processes are kept active.
+#define         LOAD_CONTROL_WINDOW          2000
+#define         LOAD_CONTROL_UPPER_THRESHOLD   40
+#define         LOAD_CONTROL_LOWER_THRESHOLD   10
+#define         LOAD_CONTROL_MIN_ACTIVE         2
+
+//  Same-page merging: every MERGE_SCAN_INTERVAL faults, and when idle and
+//  short of frames, frames with identical contents are folded into one
+//  read-only frame.  Change FALSE to TRUE to turn the scanner on.
+#define         PAGE_MERGING                    FALSE
+#define         MERGE_SCAN_INTERVAL            64
+
+//  Disk scheduling: which waiting request each disk serves next.  FIFO
+//  takes them in arrival order, SSTF the one nearest the head, SCAN sweeps
+//  up and down, and C-LOOK sweeps up and jumps back to the lowest request.
+#define         DISK_SCHED_FIFO                 0
+#define         DISK_SCHED_SSTF                 1
+#define         DISK_SCHED_SCAN                 2
+#define         DISK_SCHED_CLOOK                3
+#define         DISK_SCHEDULER                  DISK_SCHED_CLOOK
+
+//  Buffer cache of file-system sectors.  Under 2Q a sector read once waits
+//  in a small FIFO probation queue, and only one asked for again after
+//  leaving it (it is remembered among the ghosts) joins the LRU main queue.
+//  Dirty sectors older than BUFFER_CACHE_FLUSH_AGE are written back while
+//  the CPU is idle.
+#define         BUFFER_CACHE_LRU                0
+#define         BUFFER_CACHE_2Q                 1
+#define         BUFFER_CACHE_POLICY             BUFFER_CACHE_2Q
+#define         BUFFER_CACHE_SECTORS          128
+#define         BUFFER_CACHE_BUCKETS          256
+#define         BUFFER_CACHE_PROBATION         32       // 2Q's A1in, a quarter of the cache
+#define         BUFFER_CACHE_GHOSTS            64       // 2Q's A1out, half of it
+#define         BUFFER_CACHE_FLUSH_AGE       5000
+#define         BUFFER_FREE                     0
+#define         BUFFER_PROBATION                1
+#define         BUFFER_MAIN                     2
+
+//  Free-space bitmap: one bit per sector in 64-bit words.  On a formatted
+//  disk it is kept in BITMAP_SECTORS sectors from BITMAP_LOCATION on.
+#define         BITMAP_WORDS                  (NUMBER_LOGICAL_SECTORS/64)
+#define         BITMAP_WORDS_PER_SECTOR       (PGSIZE/8)
+#define         BITMAP_SECTORS                (BITMAP_WORDS/BITMAP_WORDS_PER_SECTOR)
+#define         BITMAP_LOCATION                 2
+//  Sector 0 records the bitmap size in units of 4 sectors, rounded up
+#define         BITMAP_SIZE_FIELD             ((BITMAP_SECTORS+3)/4)
+
+//  Each index block points to INDEX_BLOCK_FANOUT blocks of the next level.
+#define         INDEX_BLOCK_FANOUT              8
+
+//  Decoded index nodes are kept for the INDEX_CACHE_FILES files used last.
+//  A file's index tree is at most INDEX_CACHE_LEVELS deep.
+#define         INDEX_CACHE_FILES              16
+#define         INDEX_CACHE_LEVELS              3
+
+//  Directory entry cache: (disk, directory, name, kind) to header sector
+#define         DENTRY_CACHE_ENTRIES          256
+#define         DENTRY_HASH_BUCKETS           256
+#define         DENTRY_NAME_LENGTH              7
+
+//  Shared areas are named by a tag of up to this many characters.  They
+//  are pinned, so together they may take at most half of physical memory.
+#define         SHARED_AREA_TAG_LENGTH         32
+
 #endif /* z502ProcessManagement_h */